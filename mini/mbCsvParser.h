@@ -1,14 +1,89 @@
 #ifndef MBCSVPARSER_H
 #define MBCSVPARSER_H
 
+// strdup, madvise and the other POSIX calls are hidden by strict -std=c11
+// unless a feature-test macro is set before the first system include
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+// and off_t is 32-bit on 32-bit glibc without this
+#if !defined(_WIN32) && !defined(_FILE_OFFSET_BITS)
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CSV_HAVE_MMAP 1
+#define CSV_HAVE_PTHREADS 1
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// 64-bit file offsets for csv_parser_parse_incremental
+#ifdef _WIN32
+typedef long long csv_off_t;
+#define csv_ftello _ftelli64
+#define csv_fseeko _fseeki64
+#else
+typedef off_t csv_off_t;
+#define csv_ftello ftello
+#define csv_fseeko fseeko
+#endif
+
+// Compressed input is opt-in: define CSV_WITH_ZLIB (link -lz) and/or
+// CSV_WITH_ZSTD (link -lzstd) to read .gz / .zst files transparently
+#ifdef CSV_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef CSV_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define CSV_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
+#define CSV_INLINE_FIELD_LEN 256
+// Deprecated: fields are no longer capped. Kept at the old limit so code
+// that sized its own buffers with it still builds.
 #define MAX_FIELD_LEN 1024
 #define INITIAL_BUFFER_SIZE 4096
 #define INITIAL_LINE_CAPACITY 16
+#define CSV_STREAM_CHUNK_SIZE (64 * 1024)
+#define CSV_WRITER_BUFFER_SIZE (1024 * 1024)
+#define CSV_WRITER_SCAN_MIN 32
+#define CSV_ARENA_BLOCK_SIZE (64 * 1024)
+#define CSV_PARALLEL_MIN_CHUNK (256 * 1024)
+#define CSV_COLUMN_MISSING SIZE_MAX
+#define CSV_HEADER_NOT_FOUND SIZE_MAX
+#define CSV_INDEX_STRIDE 64
+#define CSV_INDEX_MAGIC "MBCSVIX1"
+#define CSV_INDEX_SUFFIX ".idx"
+#define CSV_INPUT_CHUNKS 4
+#define CSV_EXPORT_BATCH_ROWS 4096
+
+// Define CSV_ENABLE_STATS before including this header to collect the
+// counters returned by csv_parser_get_stats; otherwise they stay zero and
+// cost nothing.
+#ifdef CSV_ENABLE_STATS
+#define CSV_STAT_ADD(stats, field, amount)                                     \
+    ((stats) ? (void)((stats)->field += (amount)) : (void)0)
+#define CSV_STAT_CLOCK(var) double var = stats_clock()
+#else
+#define CSV_STAT_ADD(stats, field, amount) ((void)0)
+#define CSV_STAT_CLOCK(var) ((void)0)
+#endif
 
 // STRUCTURES
 
@@ -17,6 +92,128 @@ typedef struct CSVRow {
     size_t num_fields;
 } CSVRow;
 
+// A field slice for mapped mode. Points into the mapped file, or into the
+// parser's arena when the field needed unescaping. Not NUL-terminated.
+typedef struct CSVFieldView {
+    const char *data;
+    size_t length;
+} CSVFieldView;
+
+// A mapped-mode row: a run of num_fields entries in CSVParser::views
+typedef struct CSVRowView {
+    size_t first_field;
+    size_t num_fields;
+} CSVRowView;
+
+typedef struct CSVArenaBlock {
+    struct CSVArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} CSVArenaBlock;
+
+// Bump allocator; everything in it is released at once by arena_release
+typedef struct CSVArena {
+    CSVArenaBlock *head;
+} CSVArena;
+
+// Columnar mode storage for one column. Values are stored NUL-terminated
+// back to back in data; offsets[i] is where row i's value starts, or
+// CSV_COLUMN_MISSING if row i had no field in this column.
+typedef struct CSVColumn {
+    char *data;
+    size_t data_len;
+    size_t data_capacity;
+    size_t *offsets;
+    size_t num_values;
+    size_t offsets_capacity;
+} CSVColumn;
+
+typedef enum CSVType {
+    CSV_TYPE_AUTO,      // schema only: infer from the data
+    CSV_TYPE_STRING,    // left as text, no typed array
+    CSV_TYPE_INT64,
+    CSV_TYPE_DOUBLE,
+    CSV_TYPE_TIMESTAMP, // seconds since the Unix epoch, UTC
+} CSVType;
+
+// A column decoded once by csv_parser_decode_columns. values holds one entry
+// per row (0 where null); bit i of null_bits is set when row i was empty,
+// missing or did not parse as the column's type.
+typedef struct CSVTypedColumn {
+    CSVType type;
+    size_t length;
+    union {
+        int64_t *ints; // CSV_TYPE_INT64 and CSV_TYPE_TIMESTAMP
+        double *doubles;
+    } values;
+    uint64_t *null_bits;
+} CSVTypedColumn;
+
+// What csv_parser_resolve_header returns when a header name repeats
+typedef enum CSVDuplicateHeaders {
+    CSV_DUPLICATES_FIRST, // the leftmost column wins
+    CSV_DUPLICATES_LAST,  // the rightmost column wins
+    CSV_DUPLICATES_ERROR, // parsing fails on a repeated header
+} CSVDuplicateHeaders;
+
+// Row filters added with csv_parser_add_filter_*. A data row is stored only
+// if every filter accepts it; a row without the filtered column is rejected.
+// csv_parser_map_file fails while any filter is set.
+typedef enum CSVFilterOp {
+    CSV_FILTER_EQUALS,
+    CSV_FILTER_NOT_EQUALS,
+    CSV_FILTER_PREFIX,
+    CSV_FILTER_RANGE, // numeric, min <= value <= max
+    CSV_FILTER_CALLBACK,
+} CSVFilterOp;
+
+// Gets the row's unescaped fields as slices that are not NUL-terminated and
+// only valid during the call. Return true to keep the row.
+typedef bool (*csv_filter_callback)(const CSVFieldView *fields,
+                                    size_t num_fields, void *user_ctx);
+
+typedef struct CSVFilter {
+    CSVFilterOp op;
+    size_t column;
+    char *value; // EQUALS, NOT_EQUALS and PREFIX
+    size_t value_len;
+    double min; // RANGE
+    double max;
+    csv_filter_callback callback; // CALLBACK
+    void *user_ctx;
+} CSVFilter;
+
+// Sidecar written by csv_index_build to <file>.idx: this header followed by
+// num_checkpoints uint64_t offsets, one for every stride-th row start
+// (header row included). A row start is always outside quotes, so each
+// checkpoint is also a point where quote state is known.
+typedef struct CSVIndexHeader {
+    char magic[8];
+    uint64_t byte_order; // 0x0102030405060708 as written by this machine
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint64_t num_rows;
+    uint64_t stride;
+    uint64_t num_checkpoints;
+} CSVIndexHeader;
+
+// Counters from csv_parser_get_stats. They add up over every parse call
+// that copies fields (the file, parallel, stream and incremental paths).
+// rows_parsed includes header rows but not rows rejected by a filter.
+typedef struct CSVStats {
+    uint64_t bytes_read;
+    double read_seconds;
+    double parse_seconds;
+    uint64_t rows_parsed;
+    uint64_t fields_parsed;
+    uint64_t quoted_fields;
+    uint64_t allocations;     // heap calls for row and field storage
+    uint64_t bytes_allocated; // bytes requested, arena carve-outs included
+    uint64_t row_growths;     // reallocs of parser->rows
+    uint64_t field_growths;   // reallocs of a row's fields array
+} CSVStats;
+
 typedef struct CSVParser {
     CSVRow **rows;
     size_t num_rows;
@@ -25,6 +222,80 @@ typedef struct CSVParser {
     bool has_header;
     char **headers;
     size_t num_headers;
+
+    // open-addressing hash of header name -> column index + 1 (0 = empty),
+    // rebuilt whenever the headers change
+    size_t *header_index;
+    size_t header_index_capacity;
+    bool headers_case_insensitive;
+    CSVDuplicateHeaders duplicate_headers;
+
+    // arena mode: rows, field arrays and field bytes live in arena
+    bool use_arena;
+    CSVArena arena;
+
+    // columnar mode: fields go straight into columns, rows stays NULL and
+    // num_rows counts the rows stored
+    bool columnar;
+    CSVColumn *columns;
+    size_t num_columns;
+    size_t columns_capacity;
+
+    // typed columns from csv_parser_decode_columns
+    CSVTypedColumn *typed_columns;
+    size_t num_typed_columns;
+
+    // mapped mode, filled by csv_parser_map_file
+    char *map;
+    size_t map_size;
+    bool map_is_heap; // true when the platform fallback read the file instead
+    CSVRowView *view_rows;
+    size_t num_view_rows;
+    size_t view_rows_capacity;
+    CSVFieldView *views;
+    size_t num_views;
+    size_t views_capacity;
+    CSVArena unescaped;
+
+    // csv_parser_parse_incremental: file offset just past the last complete
+    // row consumed, plus how far past it the row boundary scan has already
+    // got (and its quote state) so a long partial row isn't rescanned
+    uint64_t tail_offset;
+    size_t tail_scan;
+    bool tail_in_quotes;
+    bool tail_header_done;
+
+    // projection: keep_columns[i] says whether field i is copied; fields past
+    // num_keep_columns and unselected ones are stored as NULL. Names given to
+    // csv_parser_select_headers wait in selected_headers until headers are
+    // parsed. NULL keep_columns and no names means every field is kept.
+    bool *keep_columns;
+    size_t num_keep_columns;
+    char **selected_headers;
+    size_t num_selected_headers;
+
+    // row filters, checked on raw field slices before a row is allocated;
+    // rows_scanned counts data rows seen and rows_kept those stored
+    CSVFilter *filters;
+    size_t num_filters;
+    size_t filters_capacity;
+    size_t rows_scanned;
+    size_t rows_kept;
+
+    // indexed mode (csv_open_indexed): map holds the source and index_map
+    // the sidecar. rows holds only the window loaded by csv_parser_load_rows,
+    // which starts at data row index_first_row.
+    bool indexed;
+    char *index_map;
+    size_t index_map_size;
+    bool index_is_heap;
+    const uint64_t *index_checkpoints;
+    size_t index_num_checkpoints;
+    size_t index_stride;
+    size_t index_num_rows; // data rows, header excluded
+    size_t index_first_row;
+
+    CSVStats stats;
 } CSVParser;
 
 typedef struct ParserState {
@@ -33,13 +304,106 @@ typedef struct ParserState {
     size_t position;
     bool in_quotes;
     char delimiter;
+
+    // arena mode: field bytes come from arena and the row's pointer array is
+    // staged in field_ptrs (reused across rows). NULL arena means malloc mode.
+    CSVArena *arena;
+    char **field_ptrs;
+    size_t num_field_ptrs;
+    size_t field_ptrs_capacity;
+
+    // columnar mode: fields are appended to this parser's columns
+    CSVParser *columnar;
+
+    // where CSV_STAT_ADD counts, or NULL
+    CSVStats *stats;
+
+    // projection mask borrowed from the parser (NULL keeps every field)
+    const bool *keep_columns;
+    size_t num_keep_columns;
+
+    // filter_row's field slices and the buffer quoted fields are unescaped to
+    CSVFieldView *filter_views;
+    size_t filter_views_capacity;
+    char *filter_scratch;
+    size_t filter_scratch_capacity;
+
+    // parse_line builds fields in a stack buffer of CSV_INLINE_FIELD_LEN and
+    // moves longer ones here; kept across rows so it only grows a few times
+    char *field_spill;
+    size_t field_spill_capacity;
 } ParserState;
 
+typedef enum CSVCodec {
+    CSV_CODEC_NONE,
+    CSV_CODEC_GZIP,
+    CSV_CODEC_ZSTD,
+} CSVCodec;
+
+// Byte source behind load_file and the chunked readers. Compression is
+// detected from the first bytes; compressed input is decoded on a worker
+// thread into a ring of CSV_INPUT_CHUNKS chunks so it overlaps parsing.
+typedef struct CSVInput {
+    FILE *file;
+    CSVCodec codec;
+    unsigned char *in; // raw bytes read from file
+    size_t in_len;
+    size_t in_pos;
+    bool in_eof;
+    bool frame_done; // the decoder is between gzip members / zstd frames
+    bool error;
+#ifdef CSV_WITH_ZLIB
+    z_stream zlib;
+    bool zlib_ready;
+#endif
+#ifdef CSV_WITH_ZSTD
+    ZSTD_DCtx *zstd;
+#endif
+
+#ifdef CSV_HAVE_PTHREADS
+    // filled by the worker, drained by input_read; a zero-length chunk marks
+    // the end of the data (or an error)
+    bool threaded;
+    char *chunks[CSV_INPUT_CHUNKS];
+    size_t chunk_len[CSV_INPUT_CHUNKS];
+    size_t chunk_head;
+    size_t chunk_count;
+    size_t chunk_pos;
+    bool stopping;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+} CSVInput;
+
+// Called once per parsed row by csv_parser_stream_file. The row and its
+// fields are freed after the callback returns, so copy anything you need to
+// keep. Return false to stop streaming early.
+typedef bool (*csv_row_callback)(const CSVRow *row, void *user_ctx);
+
 typedef struct CSVWriter {
     FILE *file;
     char *buffer;
     size_t buffer_len;
     size_t buffer_size;
+    char delimiter;
+    bool io_error;
+
+#ifdef CSV_HAVE_PTHREADS
+    // async mode (csv_writer_open_async): buffer is one of a ring of
+    // num_buffers buffers. Full buffers are queued starting at queue_head and
+    // written by io_thread while the caller fills the next free one.
+    bool async;
+    char **buffers;
+    size_t *lengths;
+    size_t num_buffers;
+    size_t queue_head;
+    size_t queued;
+    bool stopping;
+    pthread_t io_thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
 } CSVWriter;
 
 // FUNCTION PROTOTYPES
@@ -47,22 +411,177 @@ typedef struct CSVWriter {
 // EXTERNAL FUNCTIONS
 CSVParser *csv_parser_create(char delimiter, bool has_header);
 void csv_parser_destroy(CSVParser *parser);
+bool csv_parser_set_arena(CSVParser *parser, bool enable);
+bool csv_parser_set_columnar(CSVParser *parser, bool enable);
 bool csv_parser_parse_file(CSVParser *parser, const char *filename);
+bool csv_parser_parse_file_parallel(CSVParser *parser, const char *filename,
+                                    size_t num_threads);
+bool csv_parser_stream_file(CSVParser *parser, const char *filename,
+                            csv_row_callback callback, void *user_ctx);
+// Fails if columns are selected or filters are set: mapped rows always
+// carry every field and every row
+bool csv_parser_map_file(CSVParser *parser, const char *filename);
+bool csv_parser_parse_incremental(CSVParser *parser, const char *filename);
+bool csv_index_build(const char *filename);
+CSVParser *csv_open_indexed(const char *filename, char delimiter,
+                            bool has_header);
+bool csv_parser_load_rows(CSVParser *parser, size_t first_row, size_t count);
+size_t csv_parser_get_indexed_row_count(CSVParser *parser);
+CSVStats csv_parser_get_stats(CSVParser *parser);
+CSVFieldView csv_parser_get_field_view(CSVParser *parser, size_t row_index,
+                                       size_t field_index);
 char *csv_parser_get_field(CSVParser *parser, size_t row_index,
                            size_t field_index);
 char *csv_parser_get_field_by_header(CSVParser *parser, size_t row_index,
                                      const char *header);
+bool csv_parser_set_header_options(CSVParser *parser, bool case_insensitive,
+                                   CSVDuplicateHeaders duplicates);
+size_t csv_parser_resolve_header(CSVParser *parser, const char *header);
+bool csv_parser_select_columns(CSVParser *parser, const size_t *indices,
+                               size_t count);
+bool csv_parser_select_headers(CSVParser *parser, const char *const *names,
+                               size_t count);
+bool csv_parser_add_filter_equals(CSVParser *parser, size_t column,
+                                  const char *value);
+bool csv_parser_add_filter_not_equals(CSVParser *parser, size_t column,
+                                      const char *value);
+bool csv_parser_add_filter_prefix(CSVParser *parser, size_t column,
+                                  const char *prefix);
+bool csv_parser_add_filter_range(CSVParser *parser, size_t column, double min,
+                                 double max);
+bool csv_parser_add_filter_callback(CSVParser *parser,
+                                    csv_filter_callback callback, void *user_ctx);
+void csv_parser_clear_filters(CSVParser *parser);
+void csv_parser_get_filter_counts(CSVParser *parser, size_t *rows_scanned,
+                                  size_t *rows_kept);
+char *csv_column_get(CSVParser *parser, size_t col, size_t row);
+const CSVColumn *csv_parser_get_column(CSVParser *parser, size_t col);
+bool csv_parser_decode_columns(CSVParser *parser, const CSVType *schema,
+                               size_t schema_len);
+CSVType csv_parser_get_column_type(CSVParser *parser, size_t col);
+const int64_t *csv_parser_get_int64_column(CSVParser *parser, size_t col,
+                                           size_t *length);
+const double *csv_parser_get_double_column(CSVParser *parser, size_t col,
+                                           size_t *length);
+const int64_t *csv_parser_get_timestamp_column(CSVParser *parser, size_t col,
+                                               size_t *length);
+bool csv_parser_is_null(CSVParser *parser, size_t col, size_t row);
+CSVWriter *csv_writer_open(const char *filename, char delimiter,
+                           size_t buffer_size);
+bool csv_writer_write_row(CSVWriter *writer, const char *const *fields,
+                          size_t num_fields);
+bool csv_writer_write_parser(CSVWriter *writer, CSVParser *parser);
+bool csv_writer_write_parser_parallel(CSVWriter *writer, CSVParser *parser,
+                                      size_t num_threads);
+CSVWriter *csv_writer_open_async(const char *filename, char delimiter,
+                                 size_t buffer_size, size_t num_buffers);
+bool csv_writer_flush(CSVWriter *writer);
+bool csv_writer_close(CSVWriter *writer);
 
 // HELPER FUNCTIONS
 static bool parse_line(ParserState *state, CSVRow *row);
+static bool add_field(ParserState *state, CSVRow *row, const char *field,
+                      size_t field_len);
+static bool finish_row(ParserState *state, CSVRow *row);
+static bool grow_field(ParserState *state, char **field, size_t *capacity,
+                       size_t used, size_t needed);
+static void release_state(ParserState *state);
+static void discard_fields(ParserState *state, CSVRow *row);
+static bool column_append(CSVColumn *column, const char *value, size_t len);
+static bool column_append_missing(CSVColumn *column);
+static bool column_push_offset(CSVColumn *column, size_t offset);
+static void free_columns(CSVParser *parser);
+static void free_typed_columns(CSVParser *parser);
+static const int64_t *typed_int_values(CSVParser *parser, size_t col,
+                                       CSVType type, size_t *length);
+static bool parse_int64(const char *str, size_t len, int64_t *out);
+static bool parse_double(const char *str, size_t len, double *out);
+static bool parse_timestamp(const char *str, size_t len, int64_t *out);
+static int64_t days_from_civil(int64_t year, unsigned month, unsigned day);
+static void free_row_fields(CSVRow *row);
+static void free_rows(CSVParser *parser);
+static bool parse_rows(CSVParser *parser, ParserState *state, size_t end);
+static bool append_rows(CSVParser *parser, CSVParser *chunk);
+static size_t find_next_row_start(const char *buffer, size_t pos, size_t end,
+                                  bool in_quotes);
+static bool parse_header(CSVParser *parser, ParserState *state);
+static bool set_headers(CSVParser *parser, CSVRow *header_row);
+static bool build_header_index(CSVParser *parser);
+static size_t hash_header(const char *str, bool case_insensitive);
+static bool headers_equal(const char *a, const char *b, bool case_insensitive);
+static bool build_keep_mask(CSVParser *parser, const size_t *indices,
+                            size_t count);
+static bool resolve_selected_headers(CSVParser *parser);
+static void clear_selection(CSVParser *parser);
+static bool apply_projection(CSVParser *parser, ParserState *state);
+static bool add_filter(CSVParser *parser, CSVFilter filter, const char *value);
+static bool skip_filtered_row(CSVParser *parser, ParserState *state,
+                              bool *skipped);
+static bool slice_row(ParserState *state, size_t *num_fields, size_t *row_end);
+static bool filter_accepts(const CSVFilter *filter, const CSVFieldView *fields,
+                           size_t num_fields);
+static size_t find_last_row_end(const char *buffer, size_t length,
+                                size_t *scan_pos, bool *in_quotes);
+static bool load_file(const char *filename, char **buffer, size_t *length,
+                      size_t *buffer_size);
+static bool read_remaining(CSVInput *input, char **buffer, size_t *length,
+                           size_t *buffer_size);
+static bool reserve_chunk(ParserState *state, size_t length);
+static bool parse_chunked(CSVParser *parser, CSVInput *input);
+static CSVCodec detect_codec(const unsigned char *bytes, size_t length);
+static CSVInput *input_open(const char *filename);
+static CSVInput *input_wrap(FILE *file, bool detect);
+static size_t input_read(CSVInput *input, char *buffer, size_t size);
+static size_t decode_chunk(CSVInput *input, char *out, size_t capacity);
+static void input_close(CSVInput *input);
+#ifdef CSV_HAVE_PTHREADS
+static void *input_thread(void *arg);
+#endif
+static void *arena_alloc(CSVArena *arena, size_t size, size_t align);
+static void arena_release(CSVArena *arena);
+static void release_mapping(CSVParser *parser);
+static bool map_input(const char *filename, bool sequential, char **data,
+                      size_t *size, bool *is_heap);
+static void unmap_input(char *data, size_t size, bool is_heap);
+static int64_t file_mtime(const char *filename);
+static char *index_path(const char *filename);
+static size_t skip_rows(const char *data, size_t pos, size_t end, size_t count);
+static bool parse_index_range(CSVParser *parser, size_t start, size_t end,
+                              bool header);
+static void add_stats(CSVStats *total, const CSVStats *part);
+#ifdef CSV_ENABLE_STATS
+static double stats_clock(void);
+#endif
+static bool parse_line_view(ParserState *state, CSVParser *parser,
+                            CSVRowView *row);
+static size_t scan_special(const char *buffer, size_t pos, size_t end,
+                           char delimiter, bool in_quotes);
+static size_t scan_special_scalar(const char *buffer, size_t pos, size_t end,
+                                  char a, char b, char c);
+#ifdef CSV_HAVE_X86_SIMD
+static size_t scan_special_sse2(const char *buffer, size_t pos, size_t end,
+                                char a, char b, char c);
+static size_t scan_special_avx2(const char *buffer, size_t pos, size_t end,
+                                char a, char b, char c);
+#endif
 static bool flush_buffer_to_file(CSVWriter *writer);
+static bool add_bytes_to_buffer(CSVWriter *writer, const char *data, size_t len);
 static bool add_to_buffer(CSVWriter *writer, char c);
-static bool add_str_to_buffer(CSVWriter *writer, const char *str);
 static bool add_field_to_buffer(CSVWriter *writer, const char *field,
                                 char delimiter);
-static CSVWriter *init_writer(FILE *file);
+static CSVWriter *init_writer(FILE *file, char delimiter, size_t buffer_size);
 static void destroy_writer(CSVWriter *writer);
+static bool write_row_to_buffer(CSVWriter *writer, const char *const *fields,
+                                size_t num_fields);
 static bool write_csv_to_file(CSVWriter *writer, CSVParser *parser);
+static bool write_parser_rows(CSVWriter *writer, CSVParser *parser, size_t first,
+                              size_t end, const char **row_fields);
+static bool grow_buffer(CSVWriter *writer, size_t extra);
+#ifdef CSV_HAVE_PTHREADS
+static bool queue_buffer(CSVWriter *writer);
+static void *writer_io_thread(void *arg);
+static void *export_worker(void *arg);
+#endif
 
 // EXTERNAL FUNC IMPLEMENTATIONS
 
@@ -81,6 +600,61 @@ CSVParser *csv_parser_create(char delimiter, bool has_header) {
     parser->headers = NULL;
     parser->num_headers = 0;
 
+    parser->header_index = NULL;
+    parser->header_index_capacity = 0;
+    parser->headers_case_insensitive = false;
+    parser->duplicate_headers = CSV_DUPLICATES_FIRST;
+
+    parser->use_arena = false;
+    parser->arena.head = NULL;
+
+    parser->columnar = false;
+    parser->columns = NULL;
+    parser->num_columns = 0;
+    parser->columns_capacity = 0;
+
+    parser->typed_columns = NULL;
+    parser->num_typed_columns = 0;
+
+    parser->map = NULL;
+    parser->map_size = 0;
+    parser->map_is_heap = false;
+    parser->view_rows = NULL;
+    parser->num_view_rows = 0;
+    parser->view_rows_capacity = 0;
+    parser->views = NULL;
+    parser->num_views = 0;
+    parser->views_capacity = 0;
+    parser->unescaped.head = NULL;
+
+    parser->tail_offset = 0;
+    parser->tail_scan = 0;
+    parser->tail_in_quotes = false;
+    parser->tail_header_done = false;
+
+    parser->keep_columns = NULL;
+    parser->num_keep_columns = 0;
+    parser->selected_headers = NULL;
+    parser->num_selected_headers = 0;
+
+    parser->filters = NULL;
+    parser->num_filters = 0;
+    parser->filters_capacity = 0;
+    parser->rows_scanned = 0;
+    parser->rows_kept = 0;
+
+    parser->indexed = false;
+    parser->index_map = NULL;
+    parser->index_map_size = 0;
+    parser->index_is_heap = false;
+    parser->index_checkpoints = NULL;
+    parser->index_num_checkpoints = 0;
+    parser->index_stride = 0;
+    parser->index_num_rows = 0;
+    parser->index_first_row = 0;
+
+    memset(&parser->stats, 0, sizeof(parser->stats));
+
     return parser;
 }
 
@@ -96,419 +670,3749 @@ void csv_parser_destroy(CSVParser *parser) {
         }
         free(parser->headers);
     }
+    free(parser->header_index);
+    clear_selection(parser);
+    csv_parser_clear_filters(parser);
 
-    if (parser->rows) {
-        for (size_t i = 0; i < parser->num_rows; i++) {
-            if (parser->rows[i]) {
-                for (size_t j = 0; j < parser->rows[i]->num_fields; j++) {
-                    free(parser->rows[i]->fields[j]);
-                }
-                free(parser->rows[i]->fields);
-                free(parser->rows[i]);
-            }
-        }
-        free(parser->rows);
-    }
+    free_rows(parser);
+    free_columns(parser);
+    free_typed_columns(parser);
+    release_mapping(parser);
+    unmap_input(parser->index_map, parser->index_map_size, parser->index_is_heap);
     free(parser);
 }
 
+// Switches row storage to arena mode: rows, their field pointer arrays and
+// the field bytes are bump-allocated from large blocks, so parsing makes a
+// handful of mallocs and destroy frees one block at a time. Must be chosen
+// before any rows are parsed.
+bool csv_parser_set_arena(CSVParser *parser, bool enable) {
+    if (!parser) {
+        fputs("Invalid parser\n", stderr);
+        return false;
+    }
+    if (parser->num_rows > 0) {
+        fputs("Cannot change allocation mode after parsing\n", stderr);
+        return false;
+    }
+    parser->use_arena = enable;
+    return true;
+}
+
+// Switches row storage to columnar mode: each column is one contiguous byte
+// buffer plus an offsets array, filled directly by the parser. Use
+// csv_column_get or csv_parser_get_column to read it back;
+// csv_parser_get_field also works. Must be chosen before any rows are parsed.
+bool csv_parser_set_columnar(CSVParser *parser, bool enable) {
+    if (!parser) {
+        fputs("Invalid parser\n", stderr);
+        return false;
+    }
+    if (parser->num_rows > 0) {
+        fputs("Cannot change storage mode after parsing\n", stderr);
+        return false;
+    }
+    parser->columnar = enable;
+    return true;
+}
+
 bool csv_parser_parse_file(CSVParser *parser, const char *filename) {
     if (!parser || !filename) {
         fputs("Invalid parser or filename\n", stderr);
         return false;
     }
 
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        perror("Unable to open file");
+    CSVInput *input = input_open(filename);
+    if (!input)
         return false;
+    if (input->codec != CSV_CODEC_NONE) {
+        bool ok = parse_chunked(parser, input);
+        input_close(input);
+        return ok;
     }
 
-    ParserState state = {.buffer = malloc(INITIAL_BUFFER_SIZE * sizeof(char)),
-                         .buffer_size = INITIAL_BUFFER_SIZE,
+    ParserState state = {.buffer = NULL,
+                         .buffer_size = 0,
                          .position = 0,
                          .in_quotes = false,
                          .delimiter = parser->delimiter};
 
-    if (!state.buffer) {
-        fclose(file);
-        fputs("Failed to allocated initial buffer\n", stderr);
-        return false;
-    }
-
+    CSV_STAT_CLOCK(read_started);
     size_t total_read = 0;
-    size_t bytes_read;
-    while ((bytes_read = fread(state.buffer + total_read, 1,
-                               state.buffer_size - total_read - 1, file)) > 0) {
-        total_read += bytes_read;
-        if (total_read >= state.buffer_size - 1) {
-            size_t new_buffer_size = state.buffer_size * 2;
-            if (new_buffer_size > SIZE_MAX / 2) {
-                fputs("Buffer size too large\n", stderr);
-                free(state.buffer);
-                fclose(file);
-                return false;
-            }
-            char *new_buffer = realloc(state.buffer, new_buffer_size);
-            if (!new_buffer) {
-                fputs("Failed to reallocate buffer\n", stderr);
-                free(state.buffer);
-                fclose(file);
-                return false;
-            }
-            state.buffer = new_buffer;
-            state.buffer_size = new_buffer_size;
-        }
-    }
-    state.buffer[total_read] = '\0';
-    fclose(file);
+    bool read_ok =
+        read_remaining(input, &state.buffer, &total_read, &state.buffer_size);
+    input_close(input);
+    if (!read_ok)
+        return false;
+    CSV_STAT_ADD(&parser->stats, bytes_read, total_read);
+    CSV_STAT_CLOCK(parse_started);
+    CSV_STAT_ADD(&parser->stats, read_seconds, parse_started - read_started);
 
     // Parse the header row if the parser expects headers
-    if (parser->has_header) {
-        CSVRow header_row = {NULL, 0};
-        if (!parse_line(&state, &header_row)) {
-            fputs("Unable to parse header line\n", stderr);
-            free(state.buffer);
-            return false;
-        }
-        parser->headers = header_row.fields;
-        parser->num_headers = header_row.num_fields;
+    if (parser->has_header && !parse_header(parser, &state)) {
+        free(state.buffer);
+        return false;
     }
 
     // Parse each row in the buffer
-    while (state.position < total_read) {
-        // Expand row storage if necessary
-        if (parser->num_rows >= parser->capacity) {
-            size_t new_capacity =
-                parser->capacity == 0 ? INITIAL_LINE_CAPACITY : parser->capacity * 2;
-            CSVRow **new_rows =
-                realloc(parser->rows, new_capacity * sizeof(CSVRow *));
-            if (!new_rows) {
-                fputs("Failed to reallocate row storage\n", stderr);
-                free(state.buffer);
-                return false;
-            }
-            parser->rows = new_rows;
-            parser->capacity = new_capacity;
-        }
+    bool ok = parse_rows(parser, &state, total_read);
+    CSV_STAT_ADD(&parser->stats, parse_seconds, stats_clock() - parse_started);
 
-        // Allocate memory for the new row
-        parser->rows[parser->num_rows] = malloc(sizeof(CSVRow));
-        if (!parser->rows[parser->num_rows]) {
-            fputs("Failed to allocate memory for CSVRow\n", stderr);
-            free(state.buffer);
-            return false;
-        }
+    // Clean up
+    free(state.buffer);
+    return ok;
+}
 
-        // Initialize the new CSVRow
-        parser->rows[parser->num_rows]->fields = NULL;
-        parser->rows[parser->num_rows]->num_fields = 0;
+#ifdef CSV_HAVE_PTHREADS
+// One slice of the buffer for csv_parser_parse_file_parallel. rows is a
+// private row vector (only its row storage and arena are used) that is
+// appended to the real parser once every chunk has finished.
+typedef struct ParseChunk {
+    const char *buffer;
+    size_t buffer_size;
+    size_t start;
+    size_t end;
+    size_t quote_count;
+    CSVParser rows;
+    bool ok;
+} ParseChunk;
 
-        // Parse the line into the newly allocated row
-        if (!parse_line(&state, parser->rows[parser->num_rows])) {
-            fputs("Error parsing line\n", stderr);
-            free(state.buffer);
-            free(parser->rows[parser->num_rows]);
-            parser->rows[parser->num_rows] = NULL;
-            return false;
-        }
-        ++parser->num_rows;
+static void *count_chunk_quotes(void *arg) {
+    ParseChunk *chunk = arg;
+    size_t count = 0;
+    for (size_t i = chunk->start; i < chunk->end; i++) {
+        count += chunk->buffer[i] == '"';
     }
-
-    // Clean up
-    free(state.buffer);
-    return true;
+    chunk->quote_count = count;
+    return NULL;
 }
 
-char *csv_parser_get_field(CSVParser *parser, size_t row_index,
-                           size_t field_index) {
-    if (row_index >= parser->num_rows)
-        return NULL;
-    if (field_index >= parser->rows[row_index]->num_fields)
-        return NULL;
-    return parser->rows[row_index]->fields[field_index];
+static void *parse_chunk(void *arg) {
+    ParseChunk *chunk = arg;
+    ParserState state = {.buffer = (char *)chunk->buffer,
+                         .buffer_size = chunk->buffer_size,
+                         .position = chunk->start,
+                         .in_quotes = false,
+                         .delimiter = chunk->rows.delimiter};
+    chunk->ok = parse_rows(&chunk->rows, &state, chunk->end);
+    return NULL;
 }
+#endif
 
-char *csv_parser_get_field_by_header(CSVParser *parser, size_t row_index,
-                                     const char *header) {
-    if (!parser->has_header)
-        return NULL;
+// Splits the file into num_threads chunks (0 = one per online CPU) and parses
+// them concurrently. Chunk edges are moved to real row boundaries with a
+// two-pass scan: threads first count quotes in their nominal slice, the
+// prefix parity gives the quote state at each nominal edge, and each edge is
+// advanced to the next row terminator outside quotes. Rows are then parsed
+// per thread and appended in file order, so the result matches
+// csv_parser_parse_file exactly. Falls back to the serial parser when threads
+// are unavailable or the file is too small to be worth splitting.
+bool csv_parser_parse_file_parallel(CSVParser *parser, const char *filename,
+                                    size_t num_threads) {
+#ifndef CSV_HAVE_PTHREADS
+    (void)num_threads;
+    return csv_parser_parse_file(parser, filename);
+#else
+    if (!parser || !filename) {
+        fputs("Invalid parser or filename\n", stderr);
+        return false;
+    }
 
-    size_t header_index = 0;
-    for (; header_index < parser->num_headers; header_index++) {
-        if (strcmp(parser->headers[header_index], header) == 0)
-            break;
+    if (num_threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = online > 0 ? (size_t)online : 1;
     }
-    if (header_index >= parser->num_headers)
-        return NULL;
-    return csv_parser_get_field(parser, row_index, header_index);
-}
 
-// HELPER FUNC IMPLEMENTATIONS
+    ParserState state = {.buffer = NULL,
+                         .buffer_size = 0,
+                         .position = 0,
+                         .in_quotes = false,
+                         .delimiter = parser->delimiter};
 
-// returns false if unsuccessful
-static bool parse_line(ParserState *state, CSVRow *row) {
-    char field[MAX_FIELD_LEN];
-    size_t field_pos = 0;
-    row->num_fields = 0;
-    row->fields = NULL;
+    CSV_STAT_CLOCK(read_started);
+    size_t total_read = 0;
+    if (!load_file(filename, &state.buffer, &total_read, &state.buffer_size))
+        return false;
+    CSV_STAT_ADD(&parser->stats, bytes_read, total_read);
+    CSV_STAT_CLOCK(parse_started);
+    CSV_STAT_ADD(&parser->stats, read_seconds, parse_started - read_started);
 
-    while (state->buffer[state->position] != '\0' &&
-           (state->in_quotes || state->buffer[state->position] != '\n' &&
-                                                                              state->buffer[state->position] != '\r')) {
-        char current = state->buffer[state->position];
+    if (parser->has_header && !parse_header(parser, &state)) {
+        free(state.buffer);
+        return false;
+    }
 
-        if (current == '"' && !state->in_quotes) {
-            state->in_quotes = true;
-            ++state->position;
-            continue;
-        }
+    size_t data_start = state.position;
+    size_t data_len = total_read - data_start;
+    // Columns are filled in row order, so columnar mode parses serially
+    if (parser->columnar)
+        num_threads = 1;
+    if (num_threads > data_len / CSV_PARALLEL_MIN_CHUNK)
+        num_threads = data_len / CSV_PARALLEL_MIN_CHUNK;
+    if (num_threads <= 1) {
+        bool ok = parse_rows(parser, &state, total_read);
+        CSV_STAT_ADD(&parser->stats, parse_seconds, stats_clock() - parse_started);
+        free(state.buffer);
+        return ok;
+    }
 
-        if (current == '"' && state->in_quotes) {
-            // handle escaped quotes
-            if (state->buffer[state->position + 1] == '"') {
-                field[field_pos++] = '"';
-                state->position += 2;
-                continue;
-            }
-            // End of quoted field
-            state->in_quotes = false;
-            ++state->position;
-            continue;
-        }
+    // The workers bring their own scratch buffers
+    release_state(&state);
+    if (!apply_projection(parser, &state)) {
+        free(state.buffer);
+        return false;
+    }
 
-        if (current == state->delimiter && !state->in_quotes) {
-            // End of field, add field to row
-            field[field_pos] = '\0';
-            // Add field to row
-            char **new_fields =
-                realloc(row->fields, (row->num_fields + 1) * sizeof(char *));
-            if (!new_fields) {
-                fputs("Failed to allocate memory for fields\n", stderr);
-                // Free previously allocated fields in case of realloc failure
-                for (size_t i = 0; i < row->num_fields; i++) {
-                    free(row->fields[i]);
-                }
-                free(row->fields);
-                return false;
-            }
-            row->fields = new_fields;
-            row->fields[row->num_fields] = strdup(field);
-            if (!row->fields[row->num_fields]) {
-                fputs("Failed to duplicate field string\n", stderr);
-                // Free previously allocated fields and current row fields on error
-                for (size_t i = 0; i < row->num_fields; i++) {
-                    free(row->fields[i]);
-                }
-                free(row->fields);
-                return false;
-            }
-            ++row->num_fields;
-            field_pos = 0;
-            ++state->position;
-            continue;
-        }
+    ParseChunk *chunks = calloc(num_threads, sizeof(ParseChunk));
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    if (!chunks || !threads) {
+        fputs("Failed to allocate parse chunks\n", stderr);
+        free(chunks);
+        free(threads);
+        free(state.buffer);
+        return false;
+    }
 
-        if (field_pos >= MAX_FIELD_LEN - 1) {
-            fputs("Field length exceeds MAX_FIELD_LEN\n", stderr);
-            // Free all allocated memory if field exceeds maximum length
-            for (size_t i = 0; i < row->num_fields; i++) {
-                free(row->fields[i]);
-            }
-            free(row->fields);
-            return false;
-        }
+    for (size_t i = 0; i < num_threads; i++) {
+        chunks[i].buffer = state.buffer;
+        chunks[i].buffer_size = state.buffer_size;
+        chunks[i].start = data_start + data_len * i / num_threads;
+        chunks[i].end = data_start + data_len * (i + 1) / num_threads;
+        chunks[i].rows.delimiter = parser->delimiter;
+        chunks[i].rows.use_arena = parser->use_arena;
+        chunks[i].rows.keep_columns = parser->keep_columns;
+        chunks[i].rows.num_keep_columns = parser->num_keep_columns;
+        chunks[i].rows.filters = parser->filters;
+        chunks[i].rows.num_filters = parser->num_filters;
+    }
 
-        // Add character to field
-        field[field_pos++] = current;
-        ++state->position;
+    // Pass 1: quote counts per nominal chunk
+    size_t started = 0;
+    for (; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, count_chunk_quotes,
+                           &chunks[started]) != 0)
+            break;
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (size_t i = started; i < num_threads; i++) {
+        count_chunk_quotes(&chunks[i]);
     }
 
-    // Add the last field if there's any content or if this is not the first field
-    if (field_pos > 0 || row->num_fields > 0) {
-        field[field_pos] = '\0';
-        char **new_fields =
-            realloc(row->fields, (row->num_fields + 1) * sizeof(char *));
-        if (!new_fields) {
-            fputs("Failed to allocate memory for fields\n", stderr);
-            for (size_t i = 0; i < row->num_fields; i++) {
-                free(row->fields[i]);
-            }
-            free(row->fields);
-            return false;
-        }
-        row->fields = new_fields;
-        row->fields[row->num_fields] = strdup(field);
-        if (!row->fields[row->num_fields]) {
-            fputs("Failed to duplicate field string\n", stderr);
-            for (size_t i = 0; i < row->num_fields; i++) {
-                free(row->fields[i]);
-            }
-            free(row->fields);
-            return false;
-        }
-        ++row->num_fields;
+    // Move every inner edge forward to the next real row start
+    bool in_quotes = false;
+    for (size_t i = 1; i < num_threads; i++) {
+        if (chunks[i - 1].quote_count % 2 != 0)
+            in_quotes = !in_quotes;
+        size_t edge = find_next_row_start(state.buffer, chunks[i].start,
+                                          total_read, in_quotes);
+        if (edge < chunks[i - 1].start)
+            edge = chunks[i - 1].start;
+        chunks[i - 1].end = edge;
+        chunks[i].start = edge;
+        if (chunks[i].end < edge)
+            chunks[i].end = edge;
     }
 
-    // Handle newline characters and advance position
-    if (state->buffer[state->position] == '\r') {
-        ++state->position;
+    // Pass 2: parse chunks into private row vectors
+    for (started = 0; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, parse_chunk,
+                           &chunks[started]) != 0)
+            break;
     }
-    if (state->buffer[state->position] == '\n') {
-        ++state->position;
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (size_t i = started; i < num_threads; i++) {
+        parse_chunk(&chunks[i]);
     }
 
-    return true;
-}
+    bool ok = true;
+    for (size_t i = 0; i < num_threads; i++) {
+        if (ok && (!chunks[i].ok || !append_rows(parser, &chunks[i].rows)))
+            ok = false;
+        parser->rows_scanned += chunks[i].rows.rows_scanned;
+        parser->rows_kept += chunks[i].rows.rows_kept;
+        add_stats(&parser->stats, &chunks[i].rows.stats);
+        free_rows(&chunks[i].rows);
+    }
+
+    CSV_STAT_ADD(&parser->stats, parse_seconds, stats_clock() - parse_started);
+
+    free(chunks);
+    free(threads);
+    free(state.buffer);
+    return ok;
+#endif
+}
+
+// Reads the file in CSV_STREAM_CHUNK_SIZE chunks and hands each complete row
+// to the callback instead of storing it, so memory stays bounded by the chunk
+// size plus the widest row. A row that straddles a chunk boundary (including
+// quoted fields containing newlines) is carried over to the next read.
+// Returns true on success or when the callback asked to stop.
+bool csv_parser_stream_file(CSVParser *parser, const char *filename,
+                            csv_row_callback callback, void *user_ctx) {
+    if (!parser || !filename || !callback) {
+        fputs("Invalid parser, filename or callback\n", stderr);
+        return false;
+    }
+
+    CSVInput *input = input_open(filename);
+    if (!input)
+        return false;
+
+    ParserState state = {.buffer = malloc(CSV_STREAM_CHUNK_SIZE + 1),
+                         .buffer_size = CSV_STREAM_CHUNK_SIZE + 1,
+                         .position = 0,
+                         .in_quotes = false,
+                         .delimiter = parser->delimiter,
+                         .stats = &parser->stats};
+
+    if (!state.buffer) {
+        input_close(input);
+        fputs("Failed to allocate stream buffer\n", stderr);
+        return false;
+    }
+
+    bool header_pending = parser->has_header;
+    bool ok = true;
+    bool stopped = false;
+    bool eof = false;
+    size_t length = 0;      // bytes currently held in the buffer
+    size_t scan_pos = 0;    // where the row boundary scan resumes
+    bool scan_quotes = false;
+    if (!header_pending && !apply_projection(parser, &state))
+        ok = false;
+
+    while (ok && !stopped && !eof) {
+        // Make room for a full chunk after any carried-over partial row
+        if (!reserve_chunk(&state, length)) {
+            ok = false;
+            break;
+        }
+
+        CSV_STAT_CLOCK(read_started);
+        size_t bytes_read =
+            input_read(input, state.buffer + length, CSV_STREAM_CHUNK_SIZE);
+        if (bytes_read < CSV_STREAM_CHUNK_SIZE) {
+            if (input->error) {
+                ok = false;
+                break;
+            }
+            eof = true;
+        }
+        length += bytes_read;
+        CSV_STAT_ADD(&parser->stats, bytes_read, bytes_read);
+        CSV_STAT_CLOCK(parse_started);
+        CSV_STAT_ADD(&parser->stats, read_seconds, parse_started - read_started);
+
+        // Only parse up to the end of the last complete row; at EOF whatever
+        // is left is the final row.
+        size_t end = eof ? length
+                         : find_last_row_end(state.buffer, length, &scan_pos,
+                                             &scan_quotes);
+
+        char saved = state.buffer[end];
+        state.buffer[end] = '\0';
+        state.position = 0;
+        state.in_quotes = false;
+
+        while (state.position < end) {
+            if (!header_pending) {
+                bool skipped;
+                if (!skip_filtered_row(parser, &state, &skipped)) {
+                    ok = false;
+                    break;
+                }
+                if (skipped)
+                    continue;
+            }
+
+            CSVRow row = {NULL, 0};
+            if (!parse_line(&state, &row)) {
+                fputs("Error parsing line\n", stderr);
+                ok = false;
+                break;
+            }
+            if (header_pending) {
+                header_pending = false;
+                if (!set_headers(parser, &row) ||
+                    !apply_projection(parser, &state)) {
+                    ok = false;
+                    break;
+                }
+                continue;
+            }
+            ++parser->rows_kept;
+            bool keep_going = callback(&row, user_ctx);
+            free_row_fields(&row);
+            if (!keep_going) {
+                stopped = true;
+                break;
+            }
+        }
+        state.buffer[end] = saved;
+        // includes the time spent in the callback
+        CSV_STAT_ADD(&parser->stats, parse_seconds, stats_clock() - parse_started);
+
+        // Carry the partial trailing row over to the front of the buffer
+        memmove(state.buffer, state.buffer + end, length - end);
+        length -= end;
+        scan_pos -= end;
+    }
+
+    input_close(input);
+    free(state.buffer);
+    release_state(&state);
+    return ok;
+}
+
+// Zero-copy parse: maps the file and records each field as a slice into the
+// mapping (see csv_parser_get_field_view). Only fields containing "" escapes
+// or stray quotes are unescaped, into the parser's arena. Headers are still
+// copied so lookups by name work. The mapping lives until the parser is
+// destroyed or another file is mapped. Rows land in view_rows, not rows, so
+// csv_parser_get_field does not see them. Views are neither projected nor
+// filtered, so a column selection or row filter is refused rather than
+// silently ignored.
+bool csv_parser_map_file(CSVParser *parser, const char *filename) {
+    if (!parser || !filename) {
+        fputs("Invalid parser or filename\n", stderr);
+        return false;
+    }
+    if (parser->keep_columns || parser->num_selected_headers > 0) {
+        fputs("Column selection is not supported by csv_parser_map_file\n",
+              stderr);
+        return false;
+    }
+    if (parser->num_filters > 0) {
+        fputs("Row filters are not supported by csv_parser_map_file\n",
+              stderr);
+        return false;
+    }
+
+    release_mapping(parser);
+    if (!map_input(filename, true, &parser->map, &parser->map_size,
+                   &parser->map_is_heap))
+        return false;
+
+    ParserState state = {.buffer = parser->map,
+                         .buffer_size = parser->map_size,
+                         .position = 0,
+                         .in_quotes = false,
+                         .delimiter = parser->delimiter};
+
+    if (parser->has_header && state.position < state.buffer_size) {
+        CSVRowView header_view;
+        if (!parse_line_view(&state, parser, &header_view)) {
+            fputs("Unable to parse header line\n", stderr);
+            return false;
+        }
+        CSVRow header_row = {NULL, 0};
+        if (header_view.num_fields > 0) {
+            header_row.fields = malloc(header_view.num_fields * sizeof(char *));
+            if (!header_row.fields) {
+                fputs("Failed to allocate memory for headers\n", stderr);
+                return false;
+            }
+        }
+        for (size_t i = 0; i < header_view.num_fields; i++) {
+            CSVFieldView view = parser->views[header_view.first_field + i];
+            header_row.fields[i] = malloc(view.length + 1);
+            if (!header_row.fields[i]) {
+                fputs("Failed to duplicate header string\n", stderr);
+                free_row_fields(&header_row);
+                return false;
+            }
+            memcpy(header_row.fields[i], view.data, view.length);
+            header_row.fields[i][view.length] = '\0';
+            ++header_row.num_fields;
+        }
+        if (!set_headers(parser, &header_row))
+            return false;
+        // header slices are not part of the data rows
+        parser->num_views = 0;
+    }
+
+    while (state.position < state.buffer_size) {
+        if (parser->num_view_rows >= parser->view_rows_capacity) {
+            size_t new_capacity = parser->view_rows_capacity == 0
+                                      ? INITIAL_LINE_CAPACITY
+                                      : parser->view_rows_capacity * 2;
+            CSVRowView *new_rows =
+                realloc(parser->view_rows, new_capacity * sizeof(CSVRowView));
+            if (!new_rows) {
+                fputs("Failed to reallocate row storage\n", stderr);
+                return false;
+            }
+            parser->view_rows = new_rows;
+            parser->view_rows_capacity = new_capacity;
+        }
+        if (!parse_line_view(&state, parser,
+                             &parser->view_rows[parser->num_view_rows])) {
+            fputs("Error parsing line\n", stderr);
+            return false;
+        }
+        ++parser->num_view_rows;
+    }
+
+    return true;
+}
+
+// For files that keep growing: each call parses only the bytes appended since
+// the previous call and adds the new rows to the parser (arena and columnar
+// modes included). A trailing row without its terminator yet is left for a
+// later call, so the final row of a file is only picked up once it ends in a
+// newline. The offset is tracked separately from csv_parser_parse_file, so
+// use one or the other on a given parser. Fails if the file has shrunk.
+bool csv_parser_parse_incremental(CSVParser *parser, const char *filename) {
+    if (!parser || !filename) {
+        fputs("Invalid parser or filename\n", stderr);
+        return false;
+    }
+
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        perror("Unable to open file");
+        return false;
+    }
+    // Offsets into a compressed stream can't be resumed from
+    unsigned char magic[4];
+    size_t magic_len = fread(magic, 1, sizeof(magic), file);
+    if (detect_codec(magic, magic_len) != CSV_CODEC_NONE) {
+        fputs("Incremental parsing needs uncompressed input\n", stderr);
+        fclose(file);
+        return false;
+    }
+    csv_off_t file_size = -1;
+    if (csv_fseeko(file, 0, SEEK_END) != 0 ||
+        (file_size = csv_ftello(file)) < 0) {
+        perror("Unable to seek file");
+        fclose(file);
+        return false;
+    }
+    if ((uint64_t)file_size < parser->tail_offset) {
+        fputs("File shrank since the last incremental parse\n", stderr);
+        fclose(file);
+        return false;
+    }
+    // no larger than file_size, so it fits in csv_off_t
+    if (csv_fseeko(file, (csv_off_t)parser->tail_offset, SEEK_SET) != 0) {
+        perror("Unable to seek file");
+        fclose(file);
+        return false;
+    }
+
+    ParserState state = {.buffer = NULL,
+                         .buffer_size = 0,
+                         .position = 0,
+                         .in_quotes = false,
+                         .delimiter = parser->delimiter};
+
+    CSV_STAT_CLOCK(read_started);
+    size_t length = 0;
+    CSVInput *input = input_wrap(file, false);
+    if (!input)
+        return false;
+    bool read_ok =
+        read_remaining(input, &state.buffer, &length, &state.buffer_size);
+    input_close(input);
+    if (!read_ok)
+        return false;
+    CSV_STAT_ADD(&parser->stats, bytes_read, length);
+    CSV_STAT_CLOCK(parse_started);
+    CSV_STAT_ADD(&parser->stats, read_seconds, parse_started - read_started);
+
+    // Resume the boundary scan where the last call left off
+    size_t scan_pos = parser->tail_scan;
+    bool scan_quotes = parser->tail_in_quotes;
+    if (scan_pos > length) {
+        scan_pos = 0;
+        scan_quotes = false;
+    }
+    size_t end = find_last_row_end(state.buffer, length, &scan_pos, &scan_quotes);
+    state.buffer[end] = '\0';
+
+    bool ok = true;
+    if (end > 0 && parser->has_header && !parser->tail_header_done) {
+        ok = parse_header(parser, &state);
+        parser->tail_header_done = ok;
+    }
+    if (ok)
+        ok = parse_rows(parser, &state, end);
+    CSV_STAT_ADD(&parser->stats, parse_seconds, stats_clock() - parse_started);
+
+    // On failure keep the old offset; rows parsed so far stay in the parser
+    if (ok) {
+        parser->tail_offset += end;
+        parser->tail_scan = scan_pos - end;
+        parser->tail_in_quotes = scan_quotes;
+    }
+
+    free(state.buffer);
+    return ok;
+}
+
+// Scans the file once and writes <filename>.idx with a row-start offset for
+// every CSV_INDEX_STRIDE rows, for csv_open_indexed. Rebuild it whenever the
+// file changes; csv_open_indexed refuses an index older than its file.
+bool csv_index_build(const char *filename) {
+    if (!filename) {
+        fputs("Invalid filename\n", stderr);
+        return false;
+    }
+
+    char *data;
+    size_t size;
+    bool is_heap;
+    if (!map_input(filename, true, &data, &size, &is_heap))
+        return false;
+
+    uint64_t *checkpoints = NULL;
+    size_t num_checkpoints = 0;
+    size_t checkpoints_capacity = 0;
+    uint64_t num_rows = 0;
+    bool ok = true;
+    size_t pos = 0;
+    while (pos < size) {
+        if (num_rows % CSV_INDEX_STRIDE == 0) {
+            if (num_checkpoints >= checkpoints_capacity) {
+                size_t new_capacity = checkpoints_capacity == 0
+                                          ? INITIAL_BUFFER_SIZE
+                                          : checkpoints_capacity * 2;
+                uint64_t *new_checkpoints =
+                    realloc(checkpoints, new_capacity * sizeof(uint64_t));
+                if (!new_checkpoints) {
+                    fputs("Failed to allocate index\n", stderr);
+                    ok = false;
+                    break;
+                }
+                checkpoints = new_checkpoints;
+                checkpoints_capacity = new_capacity;
+            }
+            checkpoints[num_checkpoints++] = pos;
+        }
+        ++num_rows;
+        pos = skip_rows(data, pos, size, 1);
+    }
+    unmap_input(data, size, is_heap);
+
+    char *path = ok ? index_path(filename) : NULL;
+    FILE *file = path ? fopen(path, "wb") : NULL;
+    if (ok && path && !file)
+        perror("Unable to create index file");
+    if (file) {
+        CSVIndexHeader header = {.byte_order = 0x0102030405060708u,
+                                 .source_size = size,
+                                 .source_mtime = file_mtime(filename),
+                                 .num_rows = num_rows,
+                                 .stride = CSV_INDEX_STRIDE,
+                                 .num_checkpoints = num_checkpoints};
+        memcpy(header.magic, CSV_INDEX_MAGIC, sizeof(header.magic));
+        if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+            (num_checkpoints > 0 &&
+             fwrite(checkpoints, sizeof(uint64_t), num_checkpoints, file) !=
+                 num_checkpoints)) {
+            perror("Error writing index file");
+            ok = false;
+        }
+        if (fclose(file) != 0) {
+            perror("Error closing index file");
+            ok = false;
+        }
+    } else {
+        ok = false;
+    }
+
+    free(path);
+    free(checkpoints);
+    return ok;
+}
+
+// Opens a file indexed by csv_index_build without parsing it: the file and
+// its sidecar are mapped and only the header row is read. Load data rows with
+// csv_parser_load_rows; csv_parser_get_field then takes the same (absolute)
+// row numbers. Returns NULL if the index is missing, corrupt or stale.
+CSVParser *csv_open_indexed(const char *filename, char delimiter,
+                            bool has_header) {
+    if (!filename) {
+        fputs("Invalid filename\n", stderr);
+        return NULL;
+    }
+    char *path = index_path(filename);
+    if (!path)
+        return NULL;
+    CSVParser *parser = csv_parser_create(delimiter, has_header);
+    if (!parser) {
+        free(path);
+        return NULL;
+    }
+    parser->indexed = true;
+
+    bool ok = map_input(path, false, &parser->index_map,
+                        &parser->index_map_size, &parser->index_is_heap) &&
+              map_input(filename, false, &parser->map, &parser->map_size,
+                        &parser->map_is_heap);
+    free(path);
+
+    CSVIndexHeader header;
+    if (ok) {
+        ok = parser->index_map_size >= sizeof(header);
+        if (ok)
+            memcpy(&header, parser->index_map, sizeof(header));
+        ok = ok && memcmp(header.magic, CSV_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+             header.byte_order == 0x0102030405060708u && header.stride > 0 &&
+             header.num_checkpoints ==
+                 (header.num_rows + header.stride - 1) / header.stride &&
+             header.num_checkpoints <=
+                 (parser->index_map_size - sizeof(header)) / sizeof(uint64_t);
+        if (!ok) {
+            fputs("Invalid index file\n", stderr);
+        } else if (header.source_size != parser->map_size ||
+                   header.source_mtime != file_mtime(filename)) {
+            fputs("Index is out of date; rebuild it with csv_index_build\n",
+                  stderr);
+            ok = false;
+        }
+    }
+    if (!ok) {
+        csv_parser_destroy(parser);
+        return NULL;
+    }
+
+    // the header is 56 bytes, so the offsets are 8-byte aligned
+    parser->index_checkpoints =
+        (const uint64_t *)(void *)(parser->index_map + sizeof(header));
+    parser->index_num_checkpoints = header.num_checkpoints;
+    parser->index_stride = header.stride;
+    parser->index_num_rows = header.num_rows;
+
+    if (has_header && header.num_rows > 0) {
+        size_t end = skip_rows(parser->map, 0, parser->map_size, 1);
+        if (!parse_index_range(parser, 0, end, true)) {
+            csv_parser_destroy(parser);
+            return NULL;
+        }
+        --parser->index_num_rows;
+    }
+    return parser;
+}
+
+// Parses data rows [first_row, first_row + count) of an indexed parser,
+// replacing the previously loaded ones. count is clipped to the end of the
+// file. Only the bytes of the requested rows (plus at most a stride of rows
+// before them) are touched. Projection applies; filters do not.
+bool csv_parser_load_rows(CSVParser *parser, size_t first_row, size_t count) {
+    if (!parser || !parser->indexed) {
+        fputs("Parser was not opened with csv_open_indexed\n", stderr);
+        return false;
+    }
+    if (first_row > parser->index_num_rows) {
+        fputs("Row out of range\n", stderr);
+        return false;
+    }
+    if (count > parser->index_num_rows - first_row)
+        count = parser->index_num_rows - first_row;
+
+    free_rows(parser);
+    free_columns(parser);
+    free_typed_columns(parser);
+    parser->index_first_row = first_row;
+    if (count == 0)
+        return true;
+
+    size_t row = first_row + (parser->has_header ? 1 : 0);
+    size_t checkpoint = row / parser->index_stride;
+    size_t start = skip_rows(parser->map,
+                             (size_t)parser->index_checkpoints[checkpoint],
+                             parser->map_size, row % parser->index_stride);
+    size_t end = skip_rows(parser->map, start, parser->map_size, count);
+    return parse_index_range(parser, start, end, false);
+}
+
+// Number of data rows in an indexed file
+size_t csv_parser_get_indexed_row_count(CSVParser *parser) {
+    return parser && parser->indexed ? parser->index_num_rows : 0;
+}
+
+// Instrumentation counters; all zero unless built with CSV_ENABLE_STATS
+CSVStats csv_parser_get_stats(CSVParser *parser) {
+    CSVStats stats;
+    if (parser)
+        stats = parser->stats;
+    else
+        memset(&stats, 0, sizeof(stats));
+    return stats;
+}
+
+CSVFieldView csv_parser_get_field_view(CSVParser *parser, size_t row_index,
+                                       size_t field_index) {
+    CSVFieldView empty = {NULL, 0};
+    if (row_index >= parser->num_view_rows)
+        return empty;
+    if (field_index >= parser->view_rows[row_index].num_fields)
+        return empty;
+    return parser->views[parser->view_rows[row_index].first_field + field_index];
+}
+
+char *csv_parser_get_field(CSVParser *parser, size_t row_index,
+                           size_t field_index) {
+    if (parser->indexed) {
+        if (row_index < parser->index_first_row)
+            return NULL;
+        row_index -= parser->index_first_row;
+    }
+    if (parser->columnar)
+        return csv_column_get(parser, field_index, row_index);
+    if (row_index >= parser->num_rows)
+        return NULL;
+    if (field_index >= parser->rows[row_index]->num_fields)
+        return NULL;
+    return parser->rows[row_index]->fields[field_index];
+}
+
+char *csv_parser_get_field_by_header(CSVParser *parser, size_t row_index,
+                                     const char *header) {
+    if (!parser->has_header)
+        return NULL;
+
+    size_t header_index = csv_parser_resolve_header(parser, header);
+    if (header_index == CSV_HEADER_NOT_FOUND)
+        return NULL;
+    return csv_parser_get_field(parser, row_index, header_index);
+}
+
+// Chooses how header names are matched. Takes effect immediately, also for
+// headers that have already been parsed; returns false if the current
+// headers contain a duplicate and duplicates is CSV_DUPLICATES_ERROR.
+bool csv_parser_set_header_options(CSVParser *parser, bool case_insensitive,
+                                   CSVDuplicateHeaders duplicates) {
+    if (!parser) {
+        fputs("Invalid parser\n", stderr);
+        return false;
+    }
+    parser->headers_case_insensitive = case_insensitive;
+    parser->duplicate_headers = duplicates;
+    return build_header_index(parser);
+}
+
+// Returns the column index for a header name, or CSV_HEADER_NOT_FOUND.
+// Resolve once outside a row loop and pass the index to
+// csv_parser_get_field to skip the name lookup per row.
+size_t csv_parser_resolve_header(CSVParser *parser, const char *header) {
+    if (!parser || !header || !parser->header_index)
+        return CSV_HEADER_NOT_FOUND;
+
+    size_t mask = parser->header_index_capacity - 1;
+    size_t slot = hash_header(header, parser->headers_case_insensitive) & mask;
+    while (parser->header_index[slot] != 0) {
+        size_t index = parser->header_index[slot] - 1;
+        if (headers_equal(parser->headers[index], header,
+                          parser->headers_case_insensitive))
+            return index;
+        slot = (slot + 1) & mask;
+    }
+    return CSV_HEADER_NOT_FOUND;
+}
+
+// Parse only the given columns. Other fields are scanned over without being
+// copied and read back as NULL; kept fields keep their original index.
+// Applies to rows parsed after the call; csv_parser_map_file fails while a
+// selection is set. Pass count 0 to keep every column again.
+bool csv_parser_select_columns(CSVParser *parser, const size_t *indices,
+                               size_t count) {
+    if (!parser || (count > 0 && !indices)) {
+        fputs("Invalid parser or column selection\n", stderr);
+        return false;
+    }
+    clear_selection(parser);
+    return build_keep_mask(parser, indices, count);
+}
+
+// csv_parser_select_columns by header name. Names are resolved when the
+// header row is parsed (now, if it already has been); parsing fails if one
+// of them is not a header.
+bool csv_parser_select_headers(CSVParser *parser, const char *const *names,
+                               size_t count) {
+    if (!parser || (count > 0 && !names)) {
+        fputs("Invalid parser or column selection\n", stderr);
+        return false;
+    }
+    clear_selection(parser);
+    if (count == 0)
+        return true;
+
+    parser->selected_headers = calloc(count, sizeof(char *));
+    if (!parser->selected_headers) {
+        fputs("Failed to allocate column selection\n", stderr);
+        return false;
+    }
+    parser->num_selected_headers = count;
+    for (size_t i = 0; i < count; i++) {
+        parser->selected_headers[i] = names[i] ? strdup(names[i]) : NULL;
+        if (!parser->selected_headers[i]) {
+            fputs("Invalid or unallocatable header name\n", stderr);
+            clear_selection(parser);
+            return false;
+        }
+    }
+    if (parser->headers)
+        return resolve_selected_headers(parser);
+    return true;
+}
+
+// Keep only rows whose field at column equals value
+bool csv_parser_add_filter_equals(CSVParser *parser, size_t column,
+                                  const char *value) {
+    CSVFilter filter = {.op = CSV_FILTER_EQUALS, .column = column};
+    return add_filter(parser, filter, value);
+}
+
+// Keep only rows that have the column with a value other than value
+bool csv_parser_add_filter_not_equals(CSVParser *parser, size_t column,
+                                      const char *value) {
+    CSVFilter filter = {.op = CSV_FILTER_NOT_EQUALS, .column = column};
+    return add_filter(parser, filter, value);
+}
+
+bool csv_parser_add_filter_prefix(CSVParser *parser, size_t column,
+                                  const char *prefix) {
+    CSVFilter filter = {.op = CSV_FILTER_PREFIX, .column = column};
+    return add_filter(parser, filter, prefix);
+}
+
+// Keep only rows whose field at column is a number in [min, max]
+bool csv_parser_add_filter_range(CSVParser *parser, size_t column, double min,
+                                 double max) {
+    CSVFilter filter = {
+        .op = CSV_FILTER_RANGE, .column = column, .min = min, .max = max};
+    return add_filter(parser, filter, NULL);
+}
+
+// The callback may run concurrently from csv_parser_parse_file_parallel
+bool csv_parser_add_filter_callback(CSVParser *parser,
+                                    csv_filter_callback callback, void *user_ctx) {
+    if (!callback) {
+        fputs("Invalid filter callback\n", stderr);
+        return false;
+    }
+    CSVFilter filter = {
+        .op = CSV_FILTER_CALLBACK, .callback = callback, .user_ctx = user_ctx};
+    return add_filter(parser, filter, NULL);
+}
+
+void csv_parser_clear_filters(CSVParser *parser) {
+    if (!parser)
+        return;
+    for (size_t i = 0; i < parser->num_filters; i++) {
+        free(parser->filters[i].value);
+    }
+    free(parser->filters);
+    parser->filters = NULL;
+    parser->num_filters = 0;
+    parser->filters_capacity = 0;
+}
+
+// Data rows seen and stored so far; the two differ by the rows the filters
+// rejected. Both keep counting across parse calls.
+void csv_parser_get_filter_counts(CSVParser *parser, size_t *rows_scanned,
+                                  size_t *rows_kept) {
+    if (rows_scanned)
+        *rows_scanned = parser ? parser->rows_scanned : 0;
+    if (rows_kept)
+        *rows_kept = parser ? parser->rows_kept : 0;
+}
+
+char *csv_column_get(CSVParser *parser, size_t col, size_t row) {
+    if (!parser->columnar || col >= parser->num_columns)
+        return NULL;
+    CSVColumn *column = &parser->columns[col];
+    if (row >= column->num_values || column->offsets[row] == CSV_COLUMN_MISSING)
+        return NULL;
+    return column->data + column->offsets[row];
+}
+
+// For whole-column scans: values are data + offsets[i] for i < num_values,
+// skipping CSV_COLUMN_MISSING entries.
+const CSVColumn *csv_parser_get_column(CSVParser *parser, size_t col) {
+    if (!parser->columnar || col >= parser->num_columns)
+        return NULL;
+    return &parser->columns[col];
+}
+
+// Decodes every column once into a native array. schema[i] gives column i's
+// type; columns past schema_len, or marked CSV_TYPE_AUTO, are inferred as the
+// narrowest of int64, double and timestamp that every non-empty value parses
+// as, else left as strings. Values that do not parse as a schema type become
+// null. The parsers are hand-written and locale-independent. Works in row and
+// columnar mode; call again after parsing more rows.
+bool csv_parser_decode_columns(CSVParser *parser, const CSVType *schema,
+                               size_t schema_len) {
+    if (!parser) {
+        fputs("Invalid parser\n", stderr);
+        return false;
+    }
+    free_typed_columns(parser);
+
+    size_t num_cols = parser->columnar ? parser->num_columns : parser->num_headers;
+    if (!parser->columnar) {
+        for (size_t i = 0; i < parser->num_rows; i++) {
+            if (parser->rows[i]->num_fields > num_cols)
+                num_cols = parser->rows[i]->num_fields;
+        }
+    }
+    if (num_cols == 0)
+        return true;
+
+    parser->typed_columns = calloc(num_cols, sizeof(CSVTypedColumn));
+    if (!parser->typed_columns) {
+        fputs("Failed to allocate typed columns\n", stderr);
+        return false;
+    }
+    parser->num_typed_columns = num_cols;
+
+    size_t num_rows = parser->num_rows;
+    size_t bitmap_words = (num_rows + 63) / 64;
+    for (size_t col = 0; col < num_cols; col++) {
+        CSVTypedColumn *typed = &parser->typed_columns[col];
+        CSVType type = col < schema_len && schema ? schema[col] : CSV_TYPE_AUTO;
+
+        if (type == CSV_TYPE_AUTO) {
+            bool maybe_int = true, maybe_double = true, maybe_timestamp = true;
+            bool any_value = false;
+            for (size_t row = 0; row < num_rows; row++) {
+                const char *value = csv_parser_get_field(parser, row, col);
+                size_t len = value ? strlen(value) : 0;
+                if (len == 0)
+                    continue;
+                any_value = true;
+                int64_t i;
+                double d;
+                if (maybe_int && !parse_int64(value, len, &i))
+                    maybe_int = false;
+                if (!maybe_int && maybe_double && !parse_double(value, len, &d))
+                    maybe_double = false;
+                if (maybe_timestamp && !parse_timestamp(value, len, &i))
+                    maybe_timestamp = false;
+                if (!maybe_double && !maybe_timestamp)
+                    break;
+            }
+            if (!any_value)
+                type = CSV_TYPE_STRING;
+            else if (maybe_int)
+                type = CSV_TYPE_INT64;
+            else if (maybe_double)
+                type = CSV_TYPE_DOUBLE;
+            else if (maybe_timestamp)
+                type = CSV_TYPE_TIMESTAMP;
+            else
+                type = CSV_TYPE_STRING;
+        }
+
+        typed->type = type;
+        typed->length = num_rows;
+        if (type == CSV_TYPE_STRING || num_rows == 0)
+            continue;
+
+        typed->null_bits = calloc(bitmap_words, sizeof(uint64_t));
+        if (type == CSV_TYPE_DOUBLE)
+            typed->values.doubles = malloc(num_rows * sizeof(double));
+        else
+            typed->values.ints = malloc(num_rows * sizeof(int64_t));
+        if (!typed->null_bits || !typed->values.ints) {
+            fputs("Failed to allocate typed column\n", stderr);
+            free_typed_columns(parser);
+            return false;
+        }
+
+        for (size_t row = 0; row < num_rows; row++) {
+            const char *value = csv_parser_get_field(parser, row, col);
+            size_t len = value ? strlen(value) : 0;
+            bool ok = false;
+            if (len > 0) {
+                if (type == CSV_TYPE_INT64)
+                    ok = parse_int64(value, len, &typed->values.ints[row]);
+                else if (type == CSV_TYPE_DOUBLE)
+                    ok = parse_double(value, len, &typed->values.doubles[row]);
+                else
+                    ok = parse_timestamp(value, len, &typed->values.ints[row]);
+            }
+            if (!ok) {
+                typed->null_bits[row / 64] |= (uint64_t)1 << (row % 64);
+                if (type == CSV_TYPE_DOUBLE)
+                    typed->values.doubles[row] = 0.0;
+                else
+                    typed->values.ints[row] = 0;
+            }
+        }
+    }
+    return true;
+}
+
+CSVType csv_parser_get_column_type(CSVParser *parser, size_t col) {
+    if (col >= parser->num_typed_columns)
+        return CSV_TYPE_STRING;
+    return parser->typed_columns[col].type;
+}
+
+const int64_t *csv_parser_get_int64_column(CSVParser *parser, size_t col,
+                                           size_t *length) {
+    return typed_int_values(parser, col, CSV_TYPE_INT64, length);
+}
+
+const double *csv_parser_get_double_column(CSVParser *parser, size_t col,
+                                           size_t *length) {
+    if (col >= parser->num_typed_columns ||
+        parser->typed_columns[col].type != CSV_TYPE_DOUBLE)
+        return NULL;
+    if (length)
+        *length = parser->typed_columns[col].length;
+    return parser->typed_columns[col].values.doubles;
+}
+
+const int64_t *csv_parser_get_timestamp_column(CSVParser *parser, size_t col,
+                                               size_t *length) {
+    return typed_int_values(parser, col, CSV_TYPE_TIMESTAMP, length);
+}
+
+bool csv_parser_is_null(CSVParser *parser, size_t col, size_t row) {
+    if (col >= parser->num_typed_columns)
+        return true;
+    CSVTypedColumn *typed = &parser->typed_columns[col];
+    if (row >= typed->length || !typed->null_bits)
+        return true;
+    return (typed->null_bits[row / 64] >> (row % 64)) & 1;
+}
+
+// Opens filename for writing through a buffer of buffer_size bytes
+// (0 = CSV_WRITER_BUFFER_SIZE). Rows are formatted into the buffer with
+// bulk copies and it is written out only when full or on close.
+CSVWriter *csv_writer_open(const char *filename, char delimiter,
+                           size_t buffer_size) {
+    if (!filename) {
+        fputs("Invalid filename\n", stderr);
+        return NULL;
+    }
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        perror("Unable to open file");
+        return NULL;
+    }
+    // The writer does its own buffering; skip stdio's extra copy
+    setvbuf(file, NULL, _IONBF, 0);
+
+    CSVWriter *writer = init_writer(
+        file, delimiter, buffer_size ? buffer_size : CSV_WRITER_BUFFER_SIZE);
+    if (!writer)
+        fclose(file);
+    return writer;
+}
+
+// Writes one row, quoting fields that contain a quote, the delimiter or a
+// line break. NULL fields are written as empty.
+bool csv_writer_write_row(CSVWriter *writer, const char *const *fields,
+                          size_t num_fields) {
+    if (!writer || (!fields && num_fields > 0)) {
+        fputs("Invalid writer or fields\n", stderr);
+        return false;
+    }
+    return write_row_to_buffer(writer, fields, num_fields);
+}
+
+// Writes the parser's headers (if any) and every row
+bool csv_writer_write_parser(CSVWriter *writer, CSVParser *parser) {
+    return write_csv_to_file(writer, parser);
+}
+
+#ifdef CSV_HAVE_PTHREADS
+// Shared state for csv_writer_write_parser_parallel. Workers claim batches
+// of CSV_EXPORT_BATCH_ROWS rows in order, format them privately, then take
+// the next file offset in batch order and pwrite without holding the lock.
+typedef struct ExportJob {
+    CSVParser *parser;
+    char delimiter;
+    size_t buffer_size;
+    int fd;
+    off_t offset;       // where the next batch in order goes
+    size_t num_batches;
+    size_t next_batch;  // next batch to be claimed for formatting
+    size_t next_offset; // next batch allowed to take an offset
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ExportJob;
+#endif
+
+// csv_writer_write_parser with the rows formatted on num_threads threads
+// (0 = one per online CPU) and written with pwrite at precomputed offsets,
+// so formatting and writing both run concurrently. The output is
+// byte-for-byte what csv_writer_write_parser produces; the writer can be
+// used normally afterwards. Small parsers and builds without thread
+// support use the serial writer.
+bool csv_writer_write_parser_parallel(CSVWriter *writer, CSVParser *parser,
+                                      size_t num_threads) {
+#ifndef CSV_HAVE_PTHREADS
+    (void)num_threads;
+    return write_csv_to_file(writer, parser);
+#else
+    if (!writer || !parser) {
+        fputs("Invalid writer or parser\n", stderr);
+        return false;
+    }
+
+    if (num_threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = online > 0 ? (size_t)online : 1;
+    }
+    size_t num_batches =
+        (parser->num_rows + CSV_EXPORT_BATCH_ROWS - 1) / CSV_EXPORT_BATCH_ROWS;
+    if (num_threads > num_batches)
+        num_threads = num_batches;
+    if (num_threads <= 1)
+        return write_csv_to_file(writer, parser);
+
+    // Everything before the rows must be in the file to know where they start
+    if (parser->has_header &&
+        !write_row_to_buffer(writer, (const char *const *)parser->headers,
+                             parser->num_headers))
+        return false;
+    if (!csv_writer_flush(writer))
+        return false;
+    off_t start = ftello(writer->file);
+    if (start < 0) {
+        perror("Unable to get file position");
+        return false;
+    }
+
+    ExportJob job = {.parser = parser,
+                     .delimiter = writer->delimiter,
+                     .buffer_size = writer->buffer_size,
+                     .fd = fileno(writer->file),
+                     .offset = start,
+                     .num_batches = num_batches};
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    // The caller is one of the workers, and does everything if no thread
+    // could be started
+    pthread_t *threads = malloc((num_threads - 1) * sizeof(pthread_t));
+    size_t started = 0;
+    for (; threads && started < num_threads - 1; started++) {
+        if (pthread_create(&threads[started], NULL, export_worker, &job) != 0)
+            break;
+    }
+    export_worker(&job);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.cond);
+
+    // pwrite leaves the stream position alone; move it past the rows
+    if (!job.failed && fseeko(writer->file, job.offset, SEEK_SET) != 0) {
+        perror("Unable to seek file");
+        job.failed = true;
+    }
+    if (job.failed)
+        writer->io_error = true;
+    return !job.failed;
+#endif
+}
+
+// Like csv_writer_open, but fwrite runs on a background I/O thread so
+// formatting overlaps disk writes. The writer cycles through num_buffers
+// buffers (at least 2) of buffer_size bytes; the caller only waits when all
+// of them are queued. I/O errors are reported by csv_writer_flush and
+// csv_writer_close. Without thread support this is csv_writer_open.
+CSVWriter *csv_writer_open_async(const char *filename, char delimiter,
+                                 size_t buffer_size, size_t num_buffers) {
+    CSVWriter *writer = csv_writer_open(filename, delimiter, buffer_size);
+#ifdef CSV_HAVE_PTHREADS
+    if (!writer)
+        return NULL;
+    if (num_buffers < 2)
+        num_buffers = 2;
+
+    writer->buffers = calloc(num_buffers, sizeof(char *));
+    writer->lengths = calloc(num_buffers, sizeof(size_t));
+    writer->num_buffers = num_buffers;
+    if (writer->buffers)
+        writer->buffers[0] = writer->buffer;
+    if (!writer->buffers || !writer->lengths) {
+        fputs("Failed to allocate writer buffers\n", stderr);
+        csv_writer_close(writer);
+        return NULL;
+    }
+    for (size_t i = 1; i < num_buffers; i++) {
+        writer->buffers[i] = malloc(writer->buffer_size);
+        if (!writer->buffers[i]) {
+            fputs("Failed to allocate writer buffers\n", stderr);
+            csv_writer_close(writer);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    if (pthread_create(&writer->io_thread, NULL, writer_io_thread, writer) != 0) {
+        // still a working synchronous writer
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->cond);
+        return writer;
+    }
+    writer->async = true;
+#else
+    (void)num_buffers;
+#endif
+    return writer;
+}
+
+// Writes out everything formatted so far and waits for it to reach the file.
+// Returns false if any write since the writer was opened failed.
+bool csv_writer_flush(CSVWriter *writer) {
+    if (!writer)
+        return false;
+    bool ok = flush_buffer_to_file(writer);
+#ifdef CSV_HAVE_PTHREADS
+    if (writer->async) {
+        pthread_mutex_lock(&writer->lock);
+        while (writer->queued > 0) {
+            pthread_cond_wait(&writer->cond, &writer->lock);
+        }
+        pthread_mutex_unlock(&writer->lock);
+    }
+#endif
+    if (fflush(writer->file) != 0) {
+        perror("Error flushing file");
+        writer->io_error = true;
+    }
+    return ok && !writer->io_error;
+}
+
+// Flushes, closes the file and frees the writer. Returns false if any of
+// the output could not be written.
+bool csv_writer_close(CSVWriter *writer) {
+    if (!writer)
+        return false;
+    bool ok = flush_buffer_to_file(writer);
+#ifdef CSV_HAVE_PTHREADS
+    if (writer->async) {
+        pthread_mutex_lock(&writer->lock);
+        writer->stopping = true;
+        pthread_cond_broadcast(&writer->cond);
+        pthread_mutex_unlock(&writer->lock);
+        pthread_join(writer->io_thread, NULL);
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->cond);
+    }
+#endif
+    ok = ok && !writer->io_error;
+    if (fclose(writer->file) != 0) {
+        perror("Error closing file");
+        ok = false;
+    }
+    destroy_writer(writer);
+    return ok;
+}
+
+// HELPER FUNC IMPLEMENTATIONS
+
+// returns false if unsuccessful
+static bool parse_line(ParserState *state, CSVRow *row) {
+    char field_inline[CSV_INLINE_FIELD_LEN];
+    char *field = field_inline;
+    size_t field_capacity = CSV_INLINE_FIELD_LEN;
+    size_t field_pos = 0;
+    row->num_fields = 0;
+    row->fields = NULL;
+    state->num_field_ptrs = 0;
+
+    // Fields left out by the projection are scanned but not copied; field_pos
+    // still counts their length so empty-line detection is unchanged
+    bool skip = state->keep_columns && !state->keep_columns[0];
+
+    while (state->buffer[state->position] != '\0' &&
+           (state->in_quotes || (state->buffer[state->position] != '\n' &&
+                                 state->buffer[state->position] != '\r'))) {
+        // Copy the run up to the next byte that needs attention in one go
+        size_t run_end = scan_special(state->buffer, state->position,
+                                      state->buffer_size, state->delimiter,
+                                      state->in_quotes);
+        if (run_end > state->position) {
+            size_t run = run_end - state->position;
+            if (!skip) {
+                if (field_pos + run + 1 > field_capacity &&
+                    !grow_field(state, &field, &field_capacity, field_pos,
+                                field_pos + run + 1)) {
+                    discard_fields(state, row);
+                    return false;
+                }
+                memcpy(field + field_pos, state->buffer + state->position, run);
+            }
+            field_pos += run;
+            state->position = run_end;
+            continue;
+        }
+
+        char current = state->buffer[state->position];
+
+        if (current == '"' && !state->in_quotes) {
+            if (field_pos == 0)
+                CSV_STAT_ADD(state->stats, quoted_fields, 1);
+            state->in_quotes = true;
+            ++state->position;
+            continue;
+        }
+
+        if (current == '"' && state->in_quotes) {
+            // handle escaped quotes
+            if (state->buffer[state->position + 1] == '"') {
+                if (!skip) {
+                    if (field_pos + 2 > field_capacity &&
+                        !grow_field(state, &field, &field_capacity, field_pos,
+                                    field_pos + 2)) {
+                        discard_fields(state, row);
+                        return false;
+                    }
+                    field[field_pos] = '"';
+                }
+                ++field_pos;
+                state->position += 2;
+                continue;
+            }
+            // End of quoted field
+            state->in_quotes = false;
+            ++state->position;
+            continue;
+        }
+
+        if (current == state->delimiter && !state->in_quotes) {
+            // End of field, add field to row
+            if (skip) {
+                if (!add_field(state, row, NULL, 0))
+                    return false;
+            } else {
+                field[field_pos] = '\0';
+                if (!add_field(state, row, field, field_pos))
+                    return false;
+            }
+            field = field_inline;
+            field_capacity = CSV_INLINE_FIELD_LEN;
+            field_pos = 0;
+            skip = state->keep_columns &&
+                   (row->num_fields >= state->num_keep_columns ||
+                    !state->keep_columns[row->num_fields]);
+            ++state->position;
+            continue;
+        }
+
+        if (!skip) {
+            if (field_pos + 2 > field_capacity &&
+                !grow_field(state, &field, &field_capacity, field_pos,
+                            field_pos + 2)) {
+                discard_fields(state, row);
+                return false;
+            }
+            // Add character to field
+            field[field_pos] = current;
+        }
+        ++field_pos;
+        ++state->position;
+    }
+
+    // Add the last field if there's any content or if this is not the first field
+    if (field_pos > 0 || row->num_fields > 0) {
+        if (skip) {
+            if (!add_field(state, row, NULL, 0))
+                return false;
+        } else {
+            field[field_pos] = '\0';
+            if (!add_field(state, row, field, field_pos))
+                return false;
+        }
+    }
+
+    if (!finish_row(state, row))
+        return false;
+
+    // Handle newline characters and advance position
+    if (state->buffer[state->position] == '\r') {
+        ++state->position;
+    }
+    if (state->buffer[state->position] == '\n') {
+        ++state->position;
+    }
+
+    CSV_STAT_ADD(state->stats, rows_parsed, 1);
+    CSV_STAT_ADD(state->stats, fields_parsed, row->num_fields);
+    return true;
+}
+
+// Appends a completed field to the row. Without an arena each field is
+// strdup'd and the row's array grows by one; with an arena the bytes are
+// bump-allocated and the pointer is staged in state->field_ptrs until
+// finish_row copies the whole array into the arena at once. A NULL field
+// (skipped by the projection) is stored as NULL / a missing value.
+static bool add_field(ParserState *state, CSVRow *row, const char *field,
+                      size_t field_len) {
+    if (state->columnar) {
+        CSVParser *parser = state->columnar;
+        if (row->num_fields >= parser->num_columns) {
+            // A new column: earlier rows had no field here
+            if (parser->num_columns >= parser->columns_capacity) {
+                size_t new_capacity = parser->columns_capacity == 0
+                                          ? INITIAL_LINE_CAPACITY
+                                          : parser->columns_capacity * 2;
+                CSVColumn *new_columns =
+                    realloc(parser->columns, new_capacity * sizeof(CSVColumn));
+                if (!new_columns) {
+                    fputs("Failed to allocate memory for columns\n", stderr);
+                    discard_fields(state, row);
+                    return false;
+                }
+                parser->columns = new_columns;
+                parser->columns_capacity = new_capacity;
+            }
+            CSVColumn *column = &parser->columns[parser->num_columns++];
+            memset(column, 0, sizeof(*column));
+            for (size_t i = 0; i < parser->num_rows; i++) {
+                if (!column_append_missing(column)) {
+                    discard_fields(state, row);
+                    return false;
+                }
+            }
+        }
+        CSVColumn *column = &parser->columns[row->num_fields];
+#ifdef CSV_ENABLE_STATS
+        size_t data_capacity = column->data_capacity;
+        size_t offsets_capacity = column->offsets_capacity;
+#endif
+        if (field ? !column_append(column, field, field_len)
+                  : !column_append_missing(column)) {
+            discard_fields(state, row);
+            return false;
+        }
+#ifdef CSV_ENABLE_STATS
+        if (column->data_capacity != data_capacity) {
+            CSV_STAT_ADD(state->stats, allocations, 1);
+            CSV_STAT_ADD(state->stats, bytes_allocated, column->data_capacity);
+        }
+        if (column->offsets_capacity != offsets_capacity) {
+            CSV_STAT_ADD(state->stats, allocations, 1);
+            CSV_STAT_ADD(state->stats, bytes_allocated,
+                         column->offsets_capacity * sizeof(size_t));
+        }
+#endif
+        ++row->num_fields;
+        return true;
+    }
+
+    if (state->arena) {
+        if (state->num_field_ptrs >= state->field_ptrs_capacity) {
+            size_t new_capacity = state->field_ptrs_capacity == 0
+                                      ? INITIAL_LINE_CAPACITY
+                                      : state->field_ptrs_capacity * 2;
+            char **new_ptrs =
+                realloc(state->field_ptrs, new_capacity * sizeof(char *));
+            if (!new_ptrs) {
+                fputs("Failed to allocate memory for fields\n", stderr);
+                return false;
+            }
+            state->field_ptrs = new_ptrs;
+            state->field_ptrs_capacity = new_capacity;
+            CSV_STAT_ADD(state->stats, allocations, 1);
+            CSV_STAT_ADD(state->stats, bytes_allocated, new_capacity * sizeof(char *));
+            CSV_STAT_ADD(state->stats, field_growths, 1);
+        }
+        char *copy = NULL;
+        if (field) {
+#ifdef CSV_ENABLE_STATS
+            CSVArenaBlock *head = state->arena->head;
+#endif
+            copy = arena_alloc(state->arena, field_len + 1, 1);
+            if (!copy) {
+                fputs("Failed to duplicate field string\n", stderr);
+                return false;
+            }
+            memcpy(copy, field, field_len + 1);
+            CSV_STAT_ADD(state->stats, bytes_allocated, field_len + 1);
+#ifdef CSV_ENABLE_STATS
+            if (state->arena->head != head)
+                CSV_STAT_ADD(state->stats, allocations, 1);
+#endif
+        }
+        state->field_ptrs[state->num_field_ptrs++] = copy;
+        ++row->num_fields;
+        return true;
+    }
+
+    char **new_fields =
+        realloc(row->fields, (row->num_fields + 1) * sizeof(char *));
+    if (!new_fields) {
+        fputs("Failed to allocate memory for fields\n", stderr);
+        // Free previously allocated fields in case of realloc failure
+        discard_fields(state, row);
+        return false;
+    }
+    row->fields = new_fields;
+    CSV_STAT_ADD(state->stats, allocations, 1);
+    CSV_STAT_ADD(state->stats, bytes_allocated,
+                 (row->num_fields + 1) * sizeof(char *));
+    CSV_STAT_ADD(state->stats, field_growths, 1);
+    row->fields[row->num_fields] = field ? strdup(field) : NULL;
+    if (field && !row->fields[row->num_fields]) {
+        fputs("Failed to duplicate field string\n", stderr);
+        discard_fields(state, row);
+        return false;
+    }
+    if (field) {
+        CSV_STAT_ADD(state->stats, allocations, 1);
+        CSV_STAT_ADD(state->stats, bytes_allocated, field_len + 1);
+    }
+    ++row->num_fields;
+    return true;
+}
+
+// Moves the field being built into state->field_spill, growing it to hold at
+// least needed bytes. The spill buffer is reused by later fields and rows.
+static bool grow_field(ParserState *state, char **field, size_t *capacity,
+                       size_t used, size_t needed) {
+    if (needed > state->field_spill_capacity) {
+        size_t new_capacity = state->field_spill_capacity == 0
+                                  ? CSV_INLINE_FIELD_LEN * 4
+                                  : state->field_spill_capacity;
+        while (new_capacity < needed) {
+            if (new_capacity > SIZE_MAX / 2) {
+                fputs("Field too large\n", stderr);
+                return false;
+            }
+            new_capacity *= 2;
+        }
+        bool in_spill = *field == state->field_spill;
+        char *new_spill = realloc(state->field_spill, new_capacity);
+        if (!new_spill) {
+            fputs("Failed to grow field buffer\n", stderr);
+            return false;
+        }
+        state->field_spill = new_spill;
+        state->field_spill_capacity = new_capacity;
+        CSV_STAT_ADD(state->stats, allocations, 1);
+        CSV_STAT_ADD(state->stats, bytes_allocated, new_capacity);
+        if (in_spill)
+            *field = new_spill;
+    }
+    if (*field != state->field_spill) {
+        memcpy(state->field_spill, *field, used);
+        *field = state->field_spill;
+    }
+    *capacity = state->field_spill_capacity;
+    return true;
+}
+
+static bool finish_row(ParserState *state, CSVRow *row) {
+    if (!state->arena || row->num_fields == 0)
+        return true;
+    row->fields = arena_alloc(state->arena, row->num_fields * sizeof(char *),
+                              sizeof(char *));
+    if (!row->fields) {
+        fputs("Failed to allocate memory for fields\n", stderr);
+        row->num_fields = 0;
+        return false;
+    }
+    memcpy(row->fields, state->field_ptrs, row->num_fields * sizeof(char *));
+    CSV_STAT_ADD(state->stats, bytes_allocated, row->num_fields * sizeof(char *));
+    return true;
+}
+
+// Drops a partially parsed row. Arena memory is reclaimed with the arena.
+static void discard_fields(ParserState *state, CSVRow *row) {
+    if (state->columnar) {
+        // Drop the values this row already appended
+        CSVParser *parser = state->columnar;
+        for (size_t i = 0; i < row->num_fields && i < parser->num_columns; i++) {
+            if (parser->columns[i].num_values > parser->num_rows)
+                parser->columns[i].num_values = parser->num_rows;
+        }
+        row->num_fields = 0;
+        return;
+    }
+    if (state->arena) {
+        state->num_field_ptrs = 0;
+        row->fields = NULL;
+        row->num_fields = 0;
+        return;
+    }
+    free_row_fields(row);
+}
+
+// Appends rows to the parser until state->position reaches end. end must be
+// a row boundary (or the end of the data).
+static bool parse_rows(CSVParser *parser, ParserState *state, size_t end) {
+    // Headers stay malloc'd (set_headers frees them), data rows may not
+    state->arena = parser->use_arena ? &parser->arena : NULL;
+    state->stats = &parser->stats;
+    if (!apply_projection(parser, state)) {
+        release_state(state);
+        return false;
+    }
+
+    bool ok = true;
+    if (parser->columnar) {
+        state->arena = NULL;
+        state->columnar = parser;
+        while (ok && state->position < end) {
+            bool skipped;
+            if (!skip_filtered_row(parser, state, &skipped)) {
+                ok = false;
+                break;
+            }
+            if (skipped)
+                continue;
+
+            CSVRow row = {NULL, 0};
+            if (!parse_line(state, &row)) {
+                fputs("Error parsing line\n", stderr);
+                ok = false;
+                break;
+            }
+            // Short rows leave the remaining columns missing
+            for (size_t i = row.num_fields; i < parser->num_columns; i++) {
+                if (!column_append_missing(&parser->columns[i])) {
+                    row.num_fields = i;
+                    discard_fields(state, &row);
+                    ok = false;
+                    break;
+                }
+            }
+            if (ok) {
+                ++parser->num_rows;
+                ++parser->rows_kept;
+            }
+        }
+        state->columnar = NULL;
+        release_state(state);
+        return ok;
+    }
+
+    while (state->position < end) {
+        bool skipped;
+        if (!skip_filtered_row(parser, state, &skipped)) {
+            ok = false;
+            break;
+        }
+        if (skipped)
+            continue;
+
+        // Expand row storage if necessary
+        if (parser->num_rows >= parser->capacity) {
+            size_t new_capacity =
+                parser->capacity == 0 ? INITIAL_LINE_CAPACITY : parser->capacity * 2;
+            CSVRow **new_rows =
+                realloc(parser->rows, new_capacity * sizeof(CSVRow *));
+            if (!new_rows) {
+                fputs("Failed to reallocate row storage\n", stderr);
+                ok = false;
+                break;
+            }
+            parser->rows = new_rows;
+            parser->capacity = new_capacity;
+            CSV_STAT_ADD(state->stats, allocations, 1);
+            CSV_STAT_ADD(state->stats, bytes_allocated,
+                         new_capacity * sizeof(CSVRow *));
+            CSV_STAT_ADD(state->stats, row_growths, 1);
+        }
+
+        // Allocate memory for the new row
+        parser->rows[parser->num_rows] =
+            state->arena
+                ? arena_alloc(state->arena, sizeof(CSVRow), sizeof(void *))
+                : malloc(sizeof(CSVRow));
+        if (!parser->rows[parser->num_rows]) {
+            fputs("Failed to allocate memory for CSVRow\n", stderr);
+            ok = false;
+            break;
+        }
+
+        if (!state->arena)
+            CSV_STAT_ADD(state->stats, allocations, 1);
+        CSV_STAT_ADD(state->stats, bytes_allocated, sizeof(CSVRow));
+
+        // Initialize the new CSVRow
+        parser->rows[parser->num_rows]->fields = NULL;
+        parser->rows[parser->num_rows]->num_fields = 0;
+
+        // Parse the line into the newly allocated row
+        if (!parse_line(state, parser->rows[parser->num_rows])) {
+            fputs("Error parsing line\n", stderr);
+            if (!state->arena)
+                free(parser->rows[parser->num_rows]);
+            parser->rows[parser->num_rows] = NULL;
+            ok = false;
+            break;
+        }
+        ++parser->num_rows;
+        ++parser->rows_kept;
+    }
+
+    release_state(state);
+    return ok;
+}
+
+// Frees the scratch buffers parse_line keeps on the state between rows
+static void release_state(ParserState *state) {
+    free(state->field_ptrs);
+    state->field_ptrs = NULL;
+    state->num_field_ptrs = 0;
+    state->field_ptrs_capacity = 0;
+    free(state->field_spill);
+    state->field_spill = NULL;
+    state->field_spill_capacity = 0;
+    free(state->filter_views);
+    state->filter_views = NULL;
+    state->filter_views_capacity = 0;
+    free(state->filter_scratch);
+    state->filter_scratch = NULL;
+    state->filter_scratch_capacity = 0;
+}
+
+static bool column_append(CSVColumn *column, const char *value, size_t len) {
+    if (column->data_len + len + 1 > column->data_capacity) {
+        size_t new_capacity =
+            column->data_capacity == 0 ? INITIAL_BUFFER_SIZE : column->data_capacity;
+        while (column->data_len + len + 1 > new_capacity) {
+            new_capacity *= 2;
+        }
+        char *new_data = realloc(column->data, new_capacity);
+        if (!new_data) {
+            fputs("Failed to allocate column data\n", stderr);
+            return false;
+        }
+        column->data = new_data;
+        column->data_capacity = new_capacity;
+    }
+    if (!column_push_offset(column, column->data_len))
+        return false;
+    memcpy(column->data + column->data_len, value, len);
+    column->data[column->data_len + len] = '\0';
+    column->data_len += len + 1;
+    return true;
+}
+
+static bool column_append_missing(CSVColumn *column) {
+    return column_push_offset(column, CSV_COLUMN_MISSING);
+}
+
+static bool column_push_offset(CSVColumn *column, size_t offset) {
+    if (column->num_values >= column->offsets_capacity) {
+        size_t new_capacity = column->offsets_capacity == 0
+                                  ? INITIAL_LINE_CAPACITY
+                                  : column->offsets_capacity * 2;
+        size_t *new_offsets =
+            realloc(column->offsets, new_capacity * sizeof(size_t));
+        if (!new_offsets) {
+            fputs("Failed to allocate column offsets\n", stderr);
+            return false;
+        }
+        column->offsets = new_offsets;
+        column->offsets_capacity = new_capacity;
+    }
+    column->offsets[column->num_values++] = offset;
+    return true;
+}
+
+static void free_columns(CSVParser *parser) {
+    for (size_t i = 0; i < parser->num_columns; i++) {
+        free(parser->columns[i].data);
+        free(parser->columns[i].offsets);
+    }
+    free(parser->columns);
+    parser->columns = NULL;
+    parser->num_columns = 0;
+    parser->columns_capacity = 0;
+}
+
+static void free_typed_columns(CSVParser *parser) {
+    for (size_t i = 0; i < parser->num_typed_columns; i++) {
+        free(parser->typed_columns[i].values.ints);
+        free(parser->typed_columns[i].null_bits);
+    }
+    free(parser->typed_columns);
+    parser->typed_columns = NULL;
+    parser->num_typed_columns = 0;
+}
+
+static const int64_t *typed_int_values(CSVParser *parser, size_t col,
+                                       CSVType type, size_t *length) {
+    if (col >= parser->num_typed_columns || parser->typed_columns[col].type != type)
+        return NULL;
+    if (length)
+        *length = parser->typed_columns[col].length;
+    return parser->typed_columns[col].values.ints;
+}
+
+// [+-]digits, rejecting anything else and overflow
+static bool parse_int64(const char *str, size_t len, int64_t *out) {
+    size_t i = 0;
+    bool negative = false;
+    if (str[0] == '-' || str[0] == '+') {
+        negative = str[0] == '-';
+        ++i;
+    }
+    if (i == len)
+        return false;
+
+    uint64_t limit = negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    uint64_t value = 0;
+    for (; i < len; i++) {
+        unsigned digit = (unsigned)(str[i] - '0');
+        if (digit > 9)
+            return false;
+        if (value > (limit - digit) / 10)
+            return false;
+        value = value * 10 + digit;
+    }
+    *out = negative ? (int64_t)(0 - value) : (int64_t)value;
+    return true;
+}
+
+// [+-]digits[.digits][(e|E)[+-]digits]. Exact (correctly rounded) when the
+// significant digits fit in 2^53 and the decimal exponent is within +-22,
+// otherwise within an ulp or so.
+static bool parse_double(const char *str, size_t len, double *out) {
+    static const double powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                    1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                    1e18, 1e19, 1e20, 1e21, 1e22};
+    size_t i = 0;
+    bool negative = false;
+    if (str[0] == '-' || str[0] == '+') {
+        negative = str[0] == '-';
+        ++i;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool any_digit = false;
+    for (; i < len && (unsigned)(str[i] - '0') <= 9; i++) {
+        any_digit = true;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (unsigned)(str[i] - '0');
+            if (mantissa)
+                ++digits;
+        } else {
+            ++exponent;
+        }
+    }
+    if (i < len && str[i] == '.') {
+        for (++i; i < len && (unsigned)(str[i] - '0') <= 9; i++) {
+            any_digit = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (unsigned)(str[i] - '0');
+                if (mantissa)
+                    ++digits;
+                --exponent;
+            }
+        }
+    }
+    if (!any_digit)
+        return false;
+    if (i < len && (str[i] == 'e' || str[i] == 'E')) {
+        ++i;
+        bool exp_negative = false;
+        if (i < len && (str[i] == '-' || str[i] == '+')) {
+            exp_negative = str[i] == '-';
+            ++i;
+        }
+        if (i == len)
+            return false;
+        int exp_value = 0;
+        for (; i < len && (unsigned)(str[i] - '0') <= 9; i++) {
+            if (exp_value < 10000)
+                exp_value = exp_value * 10 + (str[i] - '0');
+        }
+        exponent += exp_negative ? -exp_value : exp_value;
+    }
+    if (i != len)
+        return false;
+
+    double value;
+    if (mantissa <= ((uint64_t)1 << 53) && exponent >= -22 && exponent <= 22) {
+        value = (double)mantissa;
+        value = exponent < 0 ? value / powers[-exponent] : value * powers[exponent];
+    } else {
+        long double scaled = (long double)mantissa;
+        int remaining = exponent < 0 ? -exponent : exponent;
+        long double factor = 1.0L;
+        while (remaining > 22) {
+            factor *= 1e22L;
+            remaining -= 22;
+            if (factor > 1e4900L)
+                break;
+        }
+        factor *= powers[remaining > 22 ? 22 : remaining];
+        scaled = exponent < 0 ? scaled / factor : scaled * factor;
+        value = (double)scaled;
+    }
+    *out = negative ? -value : value;
+    return true;
+}
+
+// YYYY-MM-DD with an optional [T ]HH:MM:SS and trailing Z, as UTC
+static bool parse_timestamp(const char *str, size_t len, int64_t *out) {
+    if (len != 10 && len != 19 && len != 20)
+        return false;
+    unsigned digits[14];
+    static const unsigned char positions[14] = {0,  1,  2,  3,  5,  6,  8,
+                                                9,  11, 12, 14, 15, 17, 18};
+    size_t num_digits = len == 10 ? 8 : 14;
+    for (size_t i = 0; i < num_digits; i++) {
+        digits[i] = (unsigned)(str[positions[i]] - '0');
+        if (digits[i] > 9)
+            return false;
+    }
+    if (str[4] != '-' || str[7] != '-')
+        return false;
+
+    int64_t year = digits[0] * 1000 + digits[1] * 100 + digits[2] * 10 + digits[3];
+    unsigned month = digits[4] * 10 + digits[5];
+    unsigned day = digits[6] * 10 + digits[7];
+    static const unsigned char month_days[12] = {31, 28, 31, 30, 31, 30,
+                                                 31, 31, 30, 31, 30, 31};
+    if (month < 1 || month > 12 || day < 1)
+        return false;
+    bool leap = year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+    if (day > month_days[month - 1] + (unsigned)(month == 2 && leap))
+        return false;
+
+    int64_t seconds = 0;
+    if (len > 10) {
+        if ((str[10] != 'T' && str[10] != ' ') || str[13] != ':' || str[16] != ':')
+            return false;
+        if (len == 20 && str[19] != 'Z')
+            return false;
+        unsigned hour = digits[8] * 10 + digits[9];
+        unsigned minute = digits[10] * 10 + digits[11];
+        unsigned second = digits[12] * 10 + digits[13];
+        if (hour > 23 || minute > 59 || second > 60)
+            return false;
+        seconds = hour * 3600 + minute * 60 + second;
+    }
+
+    *out = days_from_civil(year, month, day) * 86400 + seconds;
+    return true;
+}
+
+// Days since 1970-01-01 in the proleptic Gregorian calendar
+static int64_t days_from_civil(int64_t year, unsigned month, unsigned day) {
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    unsigned year_of_era = (unsigned)(year - era * 400);
+    unsigned day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    unsigned day_of_era =
+        year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + (int64_t)day_of_era - 719468;
+}
+
+// Moves chunk's rows onto the end of parser->rows and hands over its arena
+// blocks, leaving chunk empty.
+static bool append_rows(CSVParser *parser, CSVParser *chunk) {
+    if (parser->num_rows + chunk->num_rows > parser->capacity) {
+        size_t new_capacity = parser->num_rows + chunk->num_rows;
+        CSVRow **new_rows =
+            realloc(parser->rows, new_capacity * sizeof(CSVRow *));
+        if (!new_rows) {
+            fputs("Failed to reallocate row storage\n", stderr);
+            return false;
+        }
+        parser->rows = new_rows;
+        parser->capacity = new_capacity;
+    }
+    if (chunk->num_rows > 0) {
+        memcpy(parser->rows + parser->num_rows, chunk->rows,
+               chunk->num_rows * sizeof(CSVRow *));
+    }
+    parser->num_rows += chunk->num_rows;
+    chunk->num_rows = 0;
+
+    if (chunk->arena.head) {
+        CSVArenaBlock *tail = chunk->arena.head;
+        while (tail->next) {
+            tail = tail->next;
+        }
+        tail->next = parser->arena.head;
+        parser->arena.head = chunk->arena.head;
+        chunk->arena.head = NULL;
+    }
+    return true;
+}
+
+// Frees all data rows. In arena mode every row lives in the arena's blocks.
+static void free_rows(CSVParser *parser) {
+    if (parser->rows && !parser->use_arena) {
+        for (size_t i = 0; i < parser->num_rows; i++) {
+            if (parser->rows[i]) {
+                for (size_t j = 0; j < parser->rows[i]->num_fields; j++) {
+                    free(parser->rows[i]->fields[j]);
+                }
+                free(parser->rows[i]->fields);
+                free(parser->rows[i]);
+            }
+        }
+    }
+    free(parser->rows);
+    parser->rows = NULL;
+    parser->num_rows = 0;
+    parser->capacity = 0;
+    arena_release(&parser->arena);
+}
+
+static void free_row_fields(CSVRow *row) {
+    for (size_t i = 0; i < row->num_fields; i++) {
+        free(row->fields[i]);
+    }
+    free(row->fields);
+    row->fields = NULL;
+    row->num_fields = 0;
+}
+
+// Parses the row at state->position as the header row. Releases the state's
+// scratch buffers on failure.
+static bool parse_header(CSVParser *parser, ParserState *state) {
+    state->stats = &parser->stats;
+    CSVRow header_row = {NULL, 0};
+    if (!parse_line(state, &header_row)) {
+        fputs("Unable to parse header line\n", stderr);
+        release_state(state);
+        return false;
+    }
+    if (!set_headers(parser, &header_row)) {
+        release_state(state);
+        return false;
+    }
+    return true;
+}
+
+// takes ownership of the header row's fields, replacing any previous headers
+static bool set_headers(CSVParser *parser, CSVRow *header_row) {
+    if (parser->headers) {
+        for (size_t i = 0; i < parser->num_headers; i++) {
+            free(parser->headers[i]);
+        }
+        free(parser->headers);
+    }
+    parser->headers = header_row->fields;
+    parser->num_headers = header_row->num_fields;
+    if (!build_header_index(parser))
+        return false;
+    if (parser->num_selected_headers > 0)
+        return resolve_selected_headers(parser);
+    return true;
+}
+
+static bool build_keep_mask(CSVParser *parser, const size_t *indices,
+                            size_t count) {
+    free(parser->keep_columns);
+    parser->keep_columns = NULL;
+    parser->num_keep_columns = 0;
+    if (count == 0)
+        return true;
+
+    size_t width = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (indices[i] >= width)
+            width = indices[i] + 1;
+    }
+    parser->keep_columns = calloc(width, sizeof(bool));
+    if (!parser->keep_columns) {
+        fputs("Failed to allocate column selection\n", stderr);
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        parser->keep_columns[indices[i]] = true;
+    }
+    parser->num_keep_columns = width;
+    return true;
+}
+
+static bool resolve_selected_headers(CSVParser *parser) {
+    size_t *indices = malloc(parser->num_selected_headers * sizeof(size_t));
+    if (!indices) {
+        fputs("Failed to allocate column selection\n", stderr);
+        return false;
+    }
+    for (size_t i = 0; i < parser->num_selected_headers; i++) {
+        indices[i] = csv_parser_resolve_header(parser, parser->selected_headers[i]);
+        if (indices[i] == CSV_HEADER_NOT_FOUND) {
+            fprintf(stderr, "Selected column not found: %s\n",
+                    parser->selected_headers[i]);
+            free(indices);
+            return false;
+        }
+    }
+    bool ok = build_keep_mask(parser, indices, parser->num_selected_headers);
+    free(indices);
+    return ok;
+}
+
+static void clear_selection(CSVParser *parser) {
+    free(parser->keep_columns);
+    parser->keep_columns = NULL;
+    parser->num_keep_columns = 0;
+    for (size_t i = 0; i < parser->num_selected_headers; i++) {
+        free(parser->selected_headers[i]);
+    }
+    free(parser->selected_headers);
+    parser->selected_headers = NULL;
+    parser->num_selected_headers = 0;
+}
+
+// Points state at the parser's projection for the data rows that follow.
+// Fails if names were selected but there was no header row to resolve them.
+static bool apply_projection(CSVParser *parser, ParserState *state) {
+    if (parser->num_selected_headers > 0 && !parser->keep_columns) {
+        fputs("Selected columns by name but no header row was parsed\n", stderr);
+        return false;
+    }
+    state->keep_columns = parser->keep_columns;
+    state->num_keep_columns = parser->num_keep_columns;
+    return true;
+}
+
+// appends filter, taking a copy of value if given
+static bool add_filter(CSVParser *parser, CSVFilter filter, const char *value) {
+    if (!parser) {
+        fputs("Invalid parser\n", stderr);
+        return false;
+    }
+    if (filter.op <= CSV_FILTER_PREFIX) {
+        if (!value) {
+            fputs("Invalid filter value\n", stderr);
+            return false;
+        }
+        filter.value_len = strlen(value);
+        filter.value = strdup(value);
+        if (!filter.value) {
+            fputs("Failed to allocate filter\n", stderr);
+            return false;
+        }
+    }
+    if (parser->num_filters >= parser->filters_capacity) {
+        size_t new_capacity =
+            parser->filters_capacity == 0 ? 4 : parser->filters_capacity * 2;
+        CSVFilter *new_filters =
+            realloc(parser->filters, new_capacity * sizeof(CSVFilter));
+        if (!new_filters) {
+            fputs("Failed to allocate filter\n", stderr);
+            free(filter.value);
+            return false;
+        }
+        parser->filters = new_filters;
+        parser->filters_capacity = new_capacity;
+    }
+    parser->filters[parser->num_filters++] = filter;
+    return true;
+}
+
+// Counts the data row at state->position and, if a filter rejects it, moves
+// past it without allocating anything for it
+static bool skip_filtered_row(CSVParser *parser, ParserState *state,
+                              bool *skipped) {
+    *skipped = false;
+    ++parser->rows_scanned;
+    if (parser->num_filters == 0)
+        return true;
+
+    size_t num_fields;
+    size_t row_end;
+    if (!slice_row(state, &num_fields, &row_end))
+        return false;
+    for (size_t i = 0; i < parser->num_filters; i++) {
+        if (!filter_accepts(&parser->filters[i], state->filter_views,
+                            num_fields)) {
+            state->position = row_end;
+            *skipped = true;
+            break;
+        }
+    }
+    return true;
+}
+
+// Splits the row at state->position into state->filter_views the way
+// parse_line would, without moving state->position. Fields without quotes
+// point into the buffer; quoted ones are unescaped into filter_scratch.
+// *row_end is set past the row terminator.
+static bool slice_row(ParserState *state, size_t *num_fields, size_t *row_end) {
+    const char *buffer = state->buffer;
+    size_t pos = state->position;
+    size_t field_start = pos;
+    size_t count = 0;
+    bool in_quotes = false;
+    bool any_quotes = false;
+
+    for (;;) {
+        pos = scan_special(buffer, pos, state->buffer_size, state->delimiter,
+                           in_quotes);
+        char current = buffer[pos];
+        bool field_end = current == '\0' ||
+                         (!in_quotes && (current == state->delimiter ||
+                                         current == '\n' || current == '\r'));
+        if (!field_end) {
+            // the scanner only stops early on a quote
+            in_quotes = !in_quotes;
+            any_quotes = true;
+            ++pos;
+            continue;
+        }
+
+        if (count >= state->filter_views_capacity) {
+            size_t new_capacity = state->filter_views_capacity == 0
+                                      ? INITIAL_LINE_CAPACITY
+                                      : state->filter_views_capacity * 2;
+            CSVFieldView *new_views =
+                realloc(state->filter_views, new_capacity * sizeof(CSVFieldView));
+            if (!new_views) {
+                fputs("Failed to allocate memory for fields\n", stderr);
+                return false;
+            }
+            state->filter_views = new_views;
+            state->filter_views_capacity = new_capacity;
+        }
+        state->filter_views[count].data = buffer + field_start;
+        state->filter_views[count].length = pos - field_start;
+        ++count;
+
+        if (current != state->delimiter)
+            break;
+        field_start = ++pos;
+    }
+
+    size_t content_end = pos;
+    if (buffer[pos] == '\r')
+        ++pos;
+    if (buffer[pos] == '\n')
+        ++pos;
+    *row_end = pos;
+
+    if (any_quotes) {
+        size_t needed = content_end - state->position;
+        if (needed > state->filter_scratch_capacity) {
+            char *new_scratch = realloc(state->filter_scratch, needed);
+            if (!new_scratch) {
+                fputs("Failed to allocate memory for fields\n", stderr);
+                return false;
+            }
+            state->filter_scratch = new_scratch;
+            state->filter_scratch_capacity = needed;
+        }
+        // Same rules as parse_line: quotes toggle, "" inside quotes is one "
+        char *out = state->filter_scratch;
+        for (size_t i = 0; i < count; i++) {
+            CSVFieldView *view = &state->filter_views[i];
+            if (!memchr(view->data, '"', view->length))
+                continue;
+            const char *raw = view->data;
+            char *start = out;
+            bool quoted = false;
+            for (size_t j = 0; j < view->length; j++) {
+                if (raw[j] != '"') {
+                    *out++ = raw[j];
+                } else if (quoted && j + 1 < view->length && raw[j + 1] == '"') {
+                    *out++ = '"';
+                    ++j;
+                } else {
+                    quoted = !quoted;
+                }
+            }
+            view->data = start;
+            view->length = (size_t)(out - start);
+        }
+    }
+
+    // parse_line yields no fields for a line with no content
+    if (count == 1 && state->filter_views[0].length == 0)
+        count = 0;
+    *num_fields = count;
+    return true;
+}
+
+static bool filter_accepts(const CSVFilter *filter, const CSVFieldView *fields,
+                           size_t num_fields) {
+    if (filter->op == CSV_FILTER_CALLBACK)
+        return filter->callback(fields, num_fields, filter->user_ctx);
+    if (filter->column >= num_fields)
+        return false;
+
+    const CSVFieldView *field = &fields[filter->column];
+    switch (filter->op) {
+    case CSV_FILTER_EQUALS:
+        return field->length == filter->value_len &&
+               memcmp(field->data, filter->value, field->length) == 0;
+    case CSV_FILTER_NOT_EQUALS:
+        return field->length != filter->value_len ||
+               memcmp(field->data, filter->value, field->length) != 0;
+    case CSV_FILTER_PREFIX:
+        return field->length >= filter->value_len &&
+               memcmp(field->data, filter->value, filter->value_len) == 0;
+    case CSV_FILTER_RANGE: {
+        double value;
+        return field->length > 0 &&
+               parse_double(field->data, field->length, &value) &&
+               value >= filter->min && value <= filter->max;
+    }
+    default:
+        return false;
+    }
+}
+
+static bool build_header_index(CSVParser *parser) {
+    free(parser->header_index);
+    parser->header_index = NULL;
+    parser->header_index_capacity = 0;
+    if (parser->num_headers == 0)
+        return true;
+
+    // keep the load factor at or below one half
+    size_t capacity = 8;
+    while (capacity < parser->num_headers * 2) {
+        capacity *= 2;
+    }
+    size_t *index = calloc(capacity, sizeof(size_t));
+    if (!index) {
+        fputs("Failed to allocate header index\n", stderr);
+        return false;
+    }
+
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < parser->num_headers; i++) {
+        size_t slot =
+            hash_header(parser->headers[i], parser->headers_case_insensitive) & mask;
+        while (index[slot] != 0 &&
+               !headers_equal(parser->headers[index[slot] - 1], parser->headers[i],
+                              parser->headers_case_insensitive)) {
+            slot = (slot + 1) & mask;
+        }
+        if (index[slot] == 0 || parser->duplicate_headers == CSV_DUPLICATES_LAST) {
+            index[slot] = i + 1;
+        } else if (parser->duplicate_headers == CSV_DUPLICATES_ERROR) {
+            fprintf(stderr, "Duplicate header \"%s\"\n", parser->headers[i]);
+            free(index);
+            return false;
+        }
+    }
+
+    parser->header_index = index;
+    parser->header_index_capacity = capacity;
+    return true;
+}
+
+// FNV-1a, folding ASCII case when matching case-insensitively
+static size_t hash_header(const char *str, bool case_insensitive) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *str; str++) {
+        unsigned char c = (unsigned char)*str;
+        if (case_insensitive && c >= 'A' && c <= 'Z')
+            c = (unsigned char)(c - 'A' + 'a');
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
+
+static bool headers_equal(const char *a, const char *b, bool case_insensitive) {
+    if (!case_insensitive)
+        return strcmp(a, b) == 0;
+    for (;; a++, b++) {
+        unsigned char ca = (unsigned char)*a;
+        unsigned char cb = (unsigned char)*b;
+        if (ca >= 'A' && ca <= 'Z')
+            ca = (unsigned char)(ca - 'A' + 'a');
+        if (cb >= 'A' && cb <= 'Z')
+            cb = (unsigned char)(cb - 'A' + 'a');
+        if (ca != cb)
+            return false;
+        if (ca == '\0')
+            return true;
+    }
+}
+
+// Scans buffer[*scan_pos, length) tracking quote parity and returns the
+// offset just past the last row terminator outside quotes (0 if none).
+// Mirrors parse_line: "\r\n", "\r" and "\n" all end a row. A trailing '\r'
+// is left unscanned until the next byte shows whether it pairs with '\n'.
+static size_t find_last_row_end(const char *buffer, size_t length,
+                                size_t *scan_pos, bool *in_quotes) {
+    size_t last_end = 0;
+    size_t i = *scan_pos;
+    bool quoted = *in_quotes;
+
+    for (; i < length; i++) {
+        char c = buffer[i];
+        if (c == '"') {
+            quoted = !quoted;
+        } else if (!quoted && (c == '\n' || c == '\r')) {
+            if (c == '\r') {
+                if (i + 1 >= length)
+                    break;
+                if (buffer[i + 1] == '\n')
+                    ++i;
+            }
+            last_end = i + 1;
+        }
+    }
+
+    *scan_pos = i;
+    *in_quotes = quoted;
+    return last_end;
+}
+
+// Returns the offset just past the first row terminator outside quotes at or
+// after pos, given the quote state at pos, or end if there is none.
+static size_t find_next_row_start(const char *buffer, size_t pos, size_t end,
+                                  bool in_quotes) {
+    for (; pos < end; pos++) {
+        char c = buffer[pos];
+        if (c == '"') {
+            in_quotes = !in_quotes;
+        } else if (!in_quotes && (c == '\n' || c == '\r')) {
+            if (c == '\r' && pos + 1 < end && buffer[pos + 1] == '\n')
+                ++pos;
+            return pos + 1;
+        }
+    }
+    return end;
+}
+
+// Reads the whole file, decompressed if need be, into a NUL-terminated heap
+// buffer that doubles as it fills. *length excludes the terminator;
+// *buffer_size is the allocation.
+static bool load_file(const char *filename, char **buffer, size_t *length,
+                      size_t *buffer_size) {
+    CSVInput *input = input_open(filename);
+    if (!input)
+        return false;
+    bool ok = read_remaining(input, buffer, length, buffer_size);
+    input_close(input);
+    return ok;
+}
+
+// load_file for an already open input
+static bool read_remaining(CSVInput *input, char **buffer, size_t *length,
+                           size_t *buffer_size) {
+    size_t size = INITIAL_BUFFER_SIZE;
+    char *data = malloc(size * sizeof(char));
+    if (!data) {
+        fputs("Failed to allocated initial buffer\n", stderr);
+        return false;
+    }
+
+    size_t total_read = 0;
+    size_t bytes_read;
+    while ((bytes_read = input_read(input, data + total_read,
+                                    size - total_read - 1)) > 0) {
+        total_read += bytes_read;
+        if (total_read >= size - 1) {
+            size_t new_buffer_size = size * 2;
+            if (new_buffer_size > SIZE_MAX / 2) {
+                fputs("Buffer size too large\n", stderr);
+                free(data);
+                return false;
+            }
+            char *new_buffer = realloc(data, new_buffer_size);
+            if (!new_buffer) {
+                fputs("Failed to reallocate buffer\n", stderr);
+                free(data);
+                return false;
+            }
+            data = new_buffer;
+            size = new_buffer_size;
+        }
+    }
+    if (input->error) {
+        free(data);
+        return false;
+    }
+    data[total_read] = '\0';
+
+    *buffer = data;
+    *length = total_read;
+    *buffer_size = size;
+    return true;
+}
+
+// Makes room in state->buffer for a CSV_STREAM_CHUNK_SIZE read (plus a
+// terminator) after the length bytes already held
+static bool reserve_chunk(ParserState *state, size_t length) {
+    if (length + CSV_STREAM_CHUNK_SIZE + 1 <= state->buffer_size)
+        return true;
+    size_t new_buffer_size =
+        state->buffer_size == 0 ? CSV_STREAM_CHUNK_SIZE + 1 : state->buffer_size;
+    while (length + CSV_STREAM_CHUNK_SIZE + 1 > new_buffer_size) {
+        if (new_buffer_size > SIZE_MAX / 2) {
+            fputs("Buffer size too large\n", stderr);
+            return false;
+        }
+        new_buffer_size *= 2;
+    }
+    char *new_buffer = realloc(state->buffer, new_buffer_size);
+    if (!new_buffer) {
+        fputs("Failed to reallocate buffer\n", stderr);
+        return false;
+    }
+    state->buffer = new_buffer;
+    state->buffer_size = new_buffer_size;
+    return true;
+}
+
+// csv_parser_parse_file for compressed input: rows are parsed chunk by chunk
+// while the input's worker thread decompresses the next ones
+static bool parse_chunked(CSVParser *parser, CSVInput *input) {
+    ParserState state = {.buffer = NULL,
+                         .buffer_size = 0,
+                         .position = 0,
+                         .in_quotes = false,
+                         .delimiter = parser->delimiter};
+
+    bool header_pending = parser->has_header;
+    bool ok = true;
+    bool eof = false;
+    size_t length = 0;
+    size_t scan_pos = 0;
+    bool scan_quotes = false;
+
+    while (ok && !eof) {
+        if (!reserve_chunk(&state, length)) {
+            ok = false;
+            break;
+        }
+        CSV_STAT_CLOCK(read_started);
+        size_t bytes_read =
+            input_read(input, state.buffer + length, CSV_STREAM_CHUNK_SIZE);
+        if (bytes_read < CSV_STREAM_CHUNK_SIZE) {
+            if (input->error) {
+                ok = false;
+                break;
+            }
+            eof = true;
+        }
+        length += bytes_read;
+        CSV_STAT_ADD(&parser->stats, bytes_read, bytes_read);
+        CSV_STAT_CLOCK(parse_started);
+        CSV_STAT_ADD(&parser->stats, read_seconds, parse_started - read_started);
+
+        size_t end = eof ? length
+                         : find_last_row_end(state.buffer, length, &scan_pos,
+                                             &scan_quotes);
+        char saved = state.buffer[end];
+        state.buffer[end] = '\0';
+        state.position = 0;
+        state.in_quotes = false;
+
+        if (header_pending && end > 0) {
+            header_pending = false;
+            ok = parse_header(parser, &state);
+        }
+        if (ok)
+            ok = parse_rows(parser, &state, end);
+        state.buffer[end] = saved;
+        CSV_STAT_ADD(&parser->stats, parse_seconds, stats_clock() - parse_started);
+
+        memmove(state.buffer, state.buffer + end, length - end);
+        length -= end;
+        scan_pos -= end;
+    }
+
+    free(state.buffer);
+    release_state(&state);
+    return ok;
+}
+
+static CSVCodec detect_codec(const unsigned char *bytes, size_t length) {
+    if (length >= 2 && bytes[0] == 0x1f && bytes[1] == 0x8b)
+        return CSV_CODEC_GZIP;
+    if (length >= 4 && bytes[0] == 0x28 && bytes[1] == 0xb5 && bytes[2] == 0x2f &&
+        bytes[3] == 0xfd)
+        return CSV_CODEC_ZSTD;
+    return CSV_CODEC_NONE;
+}
+
+static CSVInput *input_open(const char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        perror("Unable to open file");
+        return NULL;
+    }
+    return input_wrap(file, true);
+}
+
+// Takes ownership of file. With detect, the first bytes are checked for a
+// compression header and a decoder thread is started if one is found.
+static CSVInput *input_wrap(FILE *file, bool detect) {
+    CSVInput *input = calloc(1, sizeof(CSVInput));
+    if (input)
+        input->in = malloc(CSV_STREAM_CHUNK_SIZE);
+    if (!input || !input->in) {
+        fputs("Failed to allocate input\n", stderr);
+        if (input)
+            free(input);
+        fclose(file);
+        return NULL;
+    }
+    input->file = file;
+    if (!detect)
+        return input;
+
+    // The peeked bytes stay in input->in and are consumed first
+    input->in_len = fread(input->in, 1, CSV_STREAM_CHUNK_SIZE, file);
+    if (ferror(file)) {
+        perror("Error reading file");
+        input_close(input);
+        return NULL;
+    }
+    input->codec = detect_codec(input->in, input->in_len);
+
+    bool ok = true;
+    if (input->codec == CSV_CODEC_GZIP) {
+#ifdef CSV_WITH_ZLIB
+        // 15 + 32: any window size, gzip or zlib header
+        ok = inflateInit2(&input->zlib, 15 + 32) == Z_OK;
+        input->zlib_ready = ok;
+        if (!ok)
+            fputs("Failed to initialise gzip decoder\n", stderr);
+#else
+        fputs("gzip input needs CSV_WITH_ZLIB\n", stderr);
+        ok = false;
+#endif
+    } else if (input->codec == CSV_CODEC_ZSTD) {
+#ifdef CSV_WITH_ZSTD
+        input->zstd = ZSTD_createDCtx();
+        ok = input->zstd != NULL;
+        if (!ok)
+            fputs("Failed to initialise zstd decoder\n", stderr);
+#else
+        fputs("zstd input needs CSV_WITH_ZSTD\n", stderr);
+        ok = false;
+#endif
+    }
+    if (!ok) {
+        input_close(input);
+        return NULL;
+    }
+
+#ifdef CSV_HAVE_PTHREADS
+    if (input->codec != CSV_CODEC_NONE) {
+        for (size_t i = 0; i < CSV_INPUT_CHUNKS; i++) {
+            input->chunks[i] = malloc(CSV_STREAM_CHUNK_SIZE);
+            if (!input->chunks[i]) {
+                fputs("Failed to allocate input\n", stderr);
+                input_close(input);
+                return NULL;
+            }
+        }
+        pthread_mutex_init(&input->lock, NULL);
+        pthread_cond_init(&input->cond, NULL);
+        if (pthread_create(&input->thread, NULL, input_thread, input) == 0) {
+            input->threaded = true;
+        } else {
+            // decode on the caller's thread instead
+            pthread_mutex_destroy(&input->lock);
+            pthread_cond_destroy(&input->cond);
+        }
+    }
+#endif
+    return input;
+}
+
+// Reads up to size bytes, decompressed if need be. Returns fewer only at the
+// end of the data or on an error, which sets input->error.
+static size_t input_read(CSVInput *input, char *buffer, size_t size) {
+    if (input->codec == CSV_CODEC_NONE) {
+        size_t total = 0;
+        if (input->in_pos < input->in_len) {
+            total = input->in_len - input->in_pos;
+            if (total > size)
+                total = size;
+            memcpy(buffer, input->in + input->in_pos, total);
+            input->in_pos += total;
+        }
+        total += fread(buffer + total, 1, size - total, input->file);
+        if (total < size && ferror(input->file)) {
+            perror("Error reading file");
+            input->error = true;
+        }
+        return total;
+    }
+
+#ifdef CSV_HAVE_PTHREADS
+    if (input->threaded) {
+        size_t total = 0;
+        pthread_mutex_lock(&input->lock);
+        while (total < size) {
+            while (input->chunk_count == 0) {
+                pthread_cond_wait(&input->cond, &input->lock);
+            }
+            size_t slot = input->chunk_head;
+            size_t available = input->chunk_len[slot] - input->chunk_pos;
+            if (input->chunk_len[slot] == 0)
+                break; // end marker, left queued for later calls
+            // The head chunk is ours until it is popped
+            pthread_mutex_unlock(&input->lock);
+            size_t n = available < size - total ? available : size - total;
+            memcpy(buffer + total, input->chunks[slot] + input->chunk_pos, n);
+            total += n;
+            pthread_mutex_lock(&input->lock);
+            input->chunk_pos += n;
+            if (input->chunk_pos == input->chunk_len[slot]) {
+                input->chunk_head = (slot + 1) % CSV_INPUT_CHUNKS;
+                --input->chunk_count;
+                input->chunk_pos = 0;
+                pthread_cond_broadcast(&input->cond);
+            }
+        }
+        pthread_mutex_unlock(&input->lock);
+        return total;
+    }
+#endif
+
+    size_t total = 0;
+    while (total < size) {
+        size_t n = decode_chunk(input, buffer + total, size - total);
+        if (n == 0)
+            break;
+        total += n;
+    }
+    return total;
+}
+
+// Decompresses into out until it is full or the input ends. Returns the
+// number of bytes produced; 0 means the end of the data or an error.
+static size_t decode_chunk(CSVInput *input, char *out, size_t capacity) {
+    size_t produced = 0;
+    while (produced < capacity && !input->error) {
+        if (input->in_pos == input->in_len) {
+            if (input->in_eof) {
+                if (!input->frame_done) {
+                    fputs("Truncated compressed input\n", stderr);
+                    input->error = true;
+                }
+                break;
+            }
+            input->in_len = fread(input->in, 1, CSV_STREAM_CHUNK_SIZE, input->file);
+            input->in_pos = 0;
+            if (input->in_len == 0) {
+                if (ferror(input->file)) {
+                    perror("Error reading file");
+                    input->error = true;
+                }
+                input->in_eof = true;
+            }
+            continue;
+        }
+
+#ifdef CSV_WITH_ZLIB
+        if (input->codec == CSV_CODEC_GZIP) {
+            // concatenated gzip members decode as one stream
+            if (input->frame_done && inflateReset(&input->zlib) != Z_OK) {
+                input->error = true;
+                break;
+            }
+            input->zlib.next_in = input->in + input->in_pos;
+            input->zlib.avail_in = (uInt)(input->in_len - input->in_pos);
+            input->zlib.next_out = (Bytef *)out + produced;
+            input->zlib.avail_out = (uInt)(capacity - produced);
+            int ret = inflate(&input->zlib, Z_NO_FLUSH);
+            produced = capacity - input->zlib.avail_out;
+            input->in_pos = input->in_len - input->zlib.avail_in;
+            input->frame_done = ret == Z_STREAM_END;
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                fputs("Corrupt gzip input\n", stderr);
+                input->error = true;
+            }
+            continue;
+        }
+#endif
+#ifdef CSV_WITH_ZSTD
+        if (input->codec == CSV_CODEC_ZSTD) {
+            ZSTD_inBuffer in = {input->in, input->in_len, input->in_pos};
+            ZSTD_outBuffer zout = {out, capacity, produced};
+            size_t ret = ZSTD_decompressStream(input->zstd, &zout, &in);
+            if (ZSTD_isError(ret)) {
+                fprintf(stderr, "Corrupt zstd input: %s\n", ZSTD_getErrorName(ret));
+                input->error = true;
+                break;
+            }
+            produced = zout.pos;
+            input->in_pos = in.pos;
+            input->frame_done = ret == 0;
+            continue;
+        }
+#endif
+        (void)out; // no decoder compiled in for this codec
+        input->error = true;
+    }
+    return input->error ? 0 : produced;
+}
+
+#ifdef CSV_HAVE_PTHREADS
+static void *input_thread(void *arg) {
+    CSVInput *input = arg;
+    pthread_mutex_lock(&input->lock);
+    for (;;) {
+        while (input->chunk_count == CSV_INPUT_CHUNKS && !input->stopping) {
+            pthread_cond_wait(&input->cond, &input->lock);
+        }
+        if (input->stopping)
+            break;
+        size_t slot = (input->chunk_head + input->chunk_count) % CSV_INPUT_CHUNKS;
+        pthread_mutex_unlock(&input->lock);
+
+        size_t len = decode_chunk(input, input->chunks[slot], CSV_STREAM_CHUNK_SIZE);
+
+        pthread_mutex_lock(&input->lock);
+        input->chunk_len[slot] = len;
+        ++input->chunk_count;
+        pthread_cond_broadcast(&input->cond);
+        if (len == 0)
+            break;
+    }
+    pthread_mutex_unlock(&input->lock);
+    return NULL;
+}
+#endif
+
+static void input_close(CSVInput *input) {
+#ifdef CSV_HAVE_PTHREADS
+    if (input->threaded) {
+        pthread_mutex_lock(&input->lock);
+        input->stopping = true;
+        pthread_cond_broadcast(&input->cond);
+        pthread_mutex_unlock(&input->lock);
+        pthread_join(input->thread, NULL);
+        pthread_mutex_destroy(&input->lock);
+        pthread_cond_destroy(&input->cond);
+    }
+    for (size_t i = 0; i < CSV_INPUT_CHUNKS; i++) {
+        free(input->chunks[i]);
+    }
+#endif
+#ifdef CSV_WITH_ZLIB
+    if (input->zlib_ready)
+        inflateEnd(&input->zlib);
+#endif
+#ifdef CSV_WITH_ZSTD
+    ZSTD_freeDCtx(input->zstd);
+#endif
+    fclose(input->file);
+    free(input->in);
+    free(input);
+}
+
+static void *arena_alloc(CSVArena *arena, size_t size, size_t align) {
+    CSVArenaBlock *block = arena->head;
+    if (block) {
+        size_t offset = (block->used + align - 1) & ~(align - 1);
+        if (offset + size <= block->size) {
+            block->used = offset + size;
+            return block->data + offset;
+        }
+    }
+
+    // Oversized requests get a block of their own
+    size_t block_size = size > CSV_ARENA_BLOCK_SIZE ? size : CSV_ARENA_BLOCK_SIZE;
+    block = malloc(sizeof(CSVArenaBlock) + block_size);
+    if (!block)
+        return NULL;
+    block->size = block_size;
+    block->used = size;
+    block->next = arena->head;
+    arena->head = block;
+    return block->data;
+}
+
+static void arena_release(CSVArena *arena) {
+    CSVArenaBlock *block = arena->head;
+    while (block) {
+        CSVArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+}
+
+static void release_mapping(CSVParser *parser) {
+    unmap_input(parser->map, parser->map_size, parser->map_is_heap);
+    parser->map = NULL;
+    parser->map_size = 0;
+    parser->map_is_heap = false;
+
+    free(parser->view_rows);
+    parser->view_rows = NULL;
+    parser->num_view_rows = 0;
+    parser->view_rows_capacity = 0;
+    free(parser->views);
+    parser->views = NULL;
+    parser->num_views = 0;
+    parser->views_capacity = 0;
+    arena_release(&parser->unescaped);
+}
+
+// Maps filename read-only, or reads it into the heap (setting *is_heap) where
+// mmap is unavailable or the file is compressed. An empty file gives a NULL
+// mapping.
+static bool map_input(const char *filename, bool sequential, char **data,
+                      size_t *size, bool *is_heap) {
+    *data = NULL;
+    *size = 0;
+    *is_heap = false;
+#ifdef CSV_HAVE_MMAP
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Unable to open file");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Unable to stat file");
+        close(fd);
+        return false;
+    }
+    if (st.st_size > 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("Unable to map file");
+            close(fd);
+            return false;
+        }
+        close(fd);
+        if (detect_codec(map, (size_t)st.st_size) != CSV_CODEC_NONE) {
+            munmap(map, (size_t)st.st_size);
+            size_t buffer_size;
+            if (!load_file(filename, data, size, &buffer_size))
+                return false;
+            *is_heap = true;
+            return true;
+        }
+#if defined(MADV_SEQUENTIAL) && defined(MADV_RANDOM)
+        // only a hint, so skip it where the includer's feature macros hide it
+        madvise(map, (size_t)st.st_size, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+#else
+        (void)sequential;
+#endif
+        *data = map;
+        *size = (size_t)st.st_size;
+        return true;
+    }
+    close(fd);
+    return true;
+#else
+    (void)sequential;
+    size_t buffer_size;
+    if (!load_file(filename, data, size, &buffer_size))
+        return false;
+    *is_heap = true;
+    return true;
+#endif
+}
+
+static void unmap_input(char *data, size_t size, bool is_heap) {
+    if (is_heap)
+        free(data);
+#ifdef CSV_HAVE_MMAP
+    else if (data)
+        munmap(data, size);
+#else
+    (void)size;
+#endif
+}
+
+// Modification time used to spot a stale index; 0 where it is not known
+static int64_t file_mtime(const char *filename) {
+#ifdef CSV_HAVE_MMAP
+    struct stat st;
+    if (stat(filename, &st) == 0)
+        return (int64_t)st.st_mtime;
+#else
+    (void)filename;
+#endif
+    return 0;
+}
+
+static char *index_path(const char *filename) {
+    size_t len = strlen(filename);
+    char *path = malloc(len + sizeof(CSV_INDEX_SUFFIX));
+    if (!path) {
+        fputs("Failed to allocate index path\n", stderr);
+        return NULL;
+    }
+    memcpy(path, filename, len);
+    memcpy(path + len, CSV_INDEX_SUFFIX, sizeof(CSV_INDEX_SUFFIX));
+    return path;
+}
+
+// Returns the offset past count more rows starting at the row start pos, or
+// end. Row terminators are found the way parse_line finds them.
+static size_t skip_rows(const char *data, size_t pos, size_t end, size_t count) {
+    bool in_quotes = false;
+    while (count > 0 && pos < end) {
+        pos = scan_special(data, pos, end, '"', in_quotes);
+        if (pos >= end)
+            break;
+        char current = data[pos++];
+        if (current == '"') {
+            in_quotes = !in_quotes;
+        } else if (!in_quotes && (current == '\n' || current == '\r')) {
+            if (current == '\r' && pos < end && data[pos] == '\n')
+                ++pos;
+            --count;
+        }
+    }
+    return pos;
+}
+
+// Parses map[start, end) from an indexed parser into its rows, or as the
+// header row. The slice is copied so parse_line sees a terminated buffer.
+static bool parse_index_range(CSVParser *parser, size_t start, size_t end,
+                              bool header) {
+    ParserState state = {.buffer = malloc(end - start + 1),
+                         .buffer_size = end - start + 1,
+                         .position = 0,
+                         .in_quotes = false,
+                         .delimiter = parser->delimiter};
+    if (!state.buffer) {
+        fputs("Failed to allocate row buffer\n", stderr);
+        return false;
+    }
+    memcpy(state.buffer, parser->map + start, end - start);
+    state.buffer[end - start] = '\0';
+
+    bool ok;
+    if (header) {
+        ok = parse_header(parser, &state);
+        release_state(&state);
+    } else {
+        // Filtering would break the row numbering, so it is left out here
+        size_t num_filters = parser->num_filters;
+        parser->num_filters = 0;
+        ok = parse_rows(parser, &state, end - start);
+        parser->num_filters = num_filters;
+    }
+    free(state.buffer);
+    return ok;
+}
+
+static void add_stats(CSVStats *total, const CSVStats *part) {
+    total->bytes_read += part->bytes_read;
+    total->read_seconds += part->read_seconds;
+    total->parse_seconds += part->parse_seconds;
+    total->rows_parsed += part->rows_parsed;
+    total->fields_parsed += part->fields_parsed;
+    total->quoted_fields += part->quoted_fields;
+    total->allocations += part->allocations;
+    total->bytes_allocated += part->bytes_allocated;
+    total->row_growths += part->row_growths;
+    total->field_growths += part->field_growths;
+}
+
+#ifdef CSV_ENABLE_STATS
+static double stats_clock(void) {
+#ifdef CSV_HAVE_MMAP
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+#endif
+
+// Mapped-mode counterpart of parse_line. The buffer is not NUL-terminated,
+// so scanning is bounded by buffer_size. Quote handling follows parse_line
+// exactly; a field whose content is a contiguous run of the input (unquoted,
+// or wrapped in one pair of quotes) is recorded as a slice, anything else is
+// unescaped into parser->unescaped.
+static bool parse_line_view(ParserState *state, CSVParser *parser,
+                            CSVRowView *row) {
+    const char *buffer = state->buffer;
+    size_t end = state->buffer_size;
+    row->first_field = parser->num_views;
+    row->num_fields = 0;
+
+    for (;;) {
+        size_t start = state->position;
+        size_t quotes = 0;
+        size_t content_len = 0;
+        bool at_row_end = false;
+
+        while (state->position < end) {
+            size_t run_end = scan_special(buffer, state->position, end,
+                                          state->delimiter, state->in_quotes);
+            content_len += run_end - state->position;
+            state->position = run_end;
+            if (state->position >= end)
+                break;
+
+            char current = buffer[state->position];
+            if (current == '"') {
+                ++quotes;
+                if (state->in_quotes && state->position + 1 < end &&
+                    buffer[state->position + 1] == '"') {
+                    ++quotes;
+                    ++content_len;
+                    state->position += 2;
+                    continue;
+                }
+                state->in_quotes = !state->in_quotes;
+                ++state->position;
+                continue;
+            }
+            if (!state->in_quotes &&
+                (current == state->delimiter || current == '\n' ||
+                 current == '\r'))
+                break;
+            ++content_len;
+            ++state->position;
+        }
+        size_t field_end = state->position;
+        if (state->position >= end || buffer[state->position] != state->delimiter)
+            at_row_end = true;
+
+        // parse_line only keeps an empty last field if it is not the first
+        if (!at_row_end || content_len > 0 || row->num_fields > 0) {
+            if (parser->num_views >= parser->views_capacity) {
+                size_t new_capacity = parser->views_capacity == 0
+                                          ? INITIAL_LINE_CAPACITY
+                                          : parser->views_capacity * 2;
+                CSVFieldView *new_views =
+                    realloc(parser->views, new_capacity * sizeof(CSVFieldView));
+                if (!new_views) {
+                    fputs("Failed to allocate memory for fields\n", stderr);
+                    return false;
+                }
+                parser->views = new_views;
+                parser->views_capacity = new_capacity;
+            }
+
+            CSVFieldView *view = &parser->views[parser->num_views];
+            if (quotes == 0) {
+                view->data = buffer + start;
+                view->length = content_len;
+            } else if (quotes == 2 && buffer[start] == '"' &&
+                       buffer[field_end - 1] == '"') {
+                view->data = buffer + start + 1;
+                view->length = content_len;
+            } else {
+                char *out = arena_alloc(&parser->unescaped, content_len, 1);
+                if (!out && content_len > 0) {
+                    fputs("Failed to allocate unescaped field\n", stderr);
+                    return false;
+                }
+                size_t out_len = 0;
+                bool quoted = false;
+                for (size_t i = start; i < field_end; i++) {
+                    if (buffer[i] == '"') {
+                        if (quoted && i + 1 < field_end && buffer[i + 1] == '"') {
+                            out[out_len++] = '"';
+                            ++i;
+                        } else {
+                            quoted = !quoted;
+                        }
+                        continue;
+                    }
+                    out[out_len++] = buffer[i];
+                }
+                view->data = out;
+                view->length = out_len;
+            }
+            ++parser->num_views;
+            ++row->num_fields;
+        }
+
+        if (at_row_end)
+            break;
+        ++state->position; // skip delimiter
+    }
+
+    // Handle newline characters and advance position
+    if (state->position < end && buffer[state->position] == '\r') {
+        ++state->position;
+    }
+    if (state->position < end && buffer[state->position] == '\n') {
+        ++state->position;
+    }
+
+    return true;
+}
+
+// Returns the offset of the first byte in buffer[pos, end) that parse_line
+// has to look at individually, or end if there is none. Outside quotes that
+// is a quote, the delimiter, '\r', '\n' or '\0'; inside quotes only a quote
+// or '\0'. The widest kernel the CPU supports is picked on first use.
+typedef size_t (*scan_fn)(const char *, size_t, size_t, char, char, char);
+static scan_fn scan_special_impl = NULL;
+
+static void pick_scan_special(void) {
+#ifdef CSV_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    scan_special_impl = __builtin_cpu_supports("avx2") ? scan_special_avx2
+                                                       : scan_special_sse2;
+#else
+    scan_special_impl = scan_special_scalar;
+#endif
+}
+
+static size_t scan_special(const char *buffer, size_t pos, size_t end,
+                           char delimiter, bool in_quotes) {
+    // Most calls land right on a delimiter or quote; skip the kernel setup
+    char first = pos < end ? buffer[pos] : '\0';
+    if (first == '"' || first == '\0' ||
+        (!in_quotes &&
+         (first == delimiter || first == '\n' || first == '\r')))
+        return pos;
+
+    // the first call may come from several threads at once
+#ifdef CSV_HAVE_PTHREADS
+    static pthread_once_t picked = PTHREAD_ONCE_INIT;
+    pthread_once(&picked, pick_scan_special);
+#else
+    if (!scan_special_impl)
+        pick_scan_special();
+#endif
+    if (in_quotes)
+        return scan_special_impl(buffer, pos, end, '"', '"', '"');
+    return scan_special_impl(buffer, pos, end, delimiter, '\n', '\r');
+}
+
+// a, b and c are matched in addition to '"' and '\0'
+static size_t scan_special_scalar(const char *buffer, size_t pos, size_t end,
+                                  char a, char b, char c) {
+    for (; pos < end; pos++) {
+        char current = buffer[pos];
+        if (current == '"' || current == '\0' || current == a || current == b ||
+            current == c)
+            break;
+    }
+    return pos;
+}
+
+#ifdef CSV_HAVE_X86_SIMD
+static size_t scan_special_sse2(const char *buffer, size_t pos, size_t end,
+                                char a, char b, char c) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    const __m128i vc = _mm_set1_epi8(c);
+
+    for (; pos + 16 <= end; pos += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(buffer + pos));
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, zero)),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, va),
+                         _mm_or_si128(_mm_cmpeq_epi8(chunk, vb),
+                                      _mm_cmpeq_epi8(chunk, vc))));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+        if (mask)
+            return pos + (size_t)__builtin_ctz(mask);
+    }
+    return scan_special_scalar(buffer, pos, end, a, b, c);
+}
+
+__attribute__((target("avx2"))) static size_t
+scan_special_avx2(const char *buffer, size_t pos, size_t end, char a, char b,
+                  char c) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    const __m256i vc = _mm256_set1_epi8(c);
+
+    for (; pos + 32 <= end; pos += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(buffer + pos));
+        __m256i hits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote),
+                            _mm256_cmpeq_epi8(chunk, zero)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, va),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, vb),
+                                            _mm256_cmpeq_epi8(chunk, vc))));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+        if (mask)
+            return pos + (size_t)__builtin_ctz(mask);
+    }
+    // The tail goes through the SSE2 kernel; clear the upper halves first,
+    // or every legacy SSE instruction after this pays the AVX transition
+    _mm256_zeroupper();
+    return scan_special_sse2(buffer, pos, end, a, b, c);
+}
+#endif
 
 static bool flush_buffer_to_file(CSVWriter *writer) {
+    if (!writer->file)
+        return grow_buffer(writer, 1);
+#ifdef CSV_HAVE_PTHREADS
+    if (writer->async)
+        return queue_buffer(writer);
+#endif
     if (writer->buffer_len > 0) {
         size_t bytes_written =
             fwrite(writer->buffer, 1, writer->buffer_len, writer->file);
         if (bytes_written != writer->buffer_len) {
             perror("Error writing buffer to file");
+            writer->io_error = true;
             return false;
         }
         writer->buffer_len = 0;
     }
+    return true;
+}
+
+#ifdef CSV_HAVE_PTHREADS
+// Hands the current buffer to the I/O thread and switches to the next free
+// one, waiting only if every buffer is still queued.
+static bool queue_buffer(CSVWriter *writer) {
+    if (writer->buffer_len == 0)
+        return !writer->io_error;
+
+    pthread_mutex_lock(&writer->lock);
+    size_t current = (writer->queue_head + writer->queued) % writer->num_buffers;
+    writer->lengths[current] = writer->buffer_len;
+    ++writer->queued;
+    pthread_cond_broadcast(&writer->cond);
+    while (writer->queued == writer->num_buffers) {
+        pthread_cond_wait(&writer->cond, &writer->lock);
+    }
+    current = (writer->queue_head + writer->queued) % writer->num_buffers;
+    bool ok = !writer->io_error;
+    pthread_mutex_unlock(&writer->lock);
+
+    writer->buffer = writer->buffers[current];
+    writer->buffer_len = 0;
+    return ok;
+}
+
+static void *writer_io_thread(void *arg) {
+    CSVWriter *writer = arg;
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        while (writer->queued == 0 && !writer->stopping) {
+            pthread_cond_wait(&writer->cond, &writer->lock);
+        }
+        if (writer->queued == 0)
+            break;
+        size_t index = writer->queue_head;
+        pthread_mutex_unlock(&writer->lock);
 
-    if (writer->buffer_size > INITIAL_BUFFER_SIZE) {
-        char *new_buffer = realloc(writer->buffer, INITIAL_BUFFER_SIZE);
-        if (!new_buffer) {
-            perror("Failed to shrink buffer. Fatal error, exiting program. (Press "
-                   "any key to continue)");
-            free(writer->buffer);
-            getchar();
-            exit(1);
+        // After an error the queue is still drained so the caller never
+        // blocks, but nothing more is written
+        bool failed = false;
+        if (!writer->io_error) {
+            size_t len = writer->lengths[index];
+            failed = fwrite(writer->buffers[index], 1, len, writer->file) != len;
+            if (failed)
+                perror("Error writing buffer to file");
         }
-        writer->buffer = new_buffer;
-        writer->buffer_size = INITIAL_BUFFER_SIZE;
+
+        pthread_mutex_lock(&writer->lock);
+        if (failed)
+            writer->io_error = true;
+        writer->queue_head = (writer->queue_head + 1) % writer->num_buffers;
+        --writer->queued;
+        pthread_cond_broadcast(&writer->cond);
     }
-    return true;
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
 }
+#endif
 
-static bool add_to_buffer(CSVWriter *writer, char c) {
-    if (writer->buffer_len >= writer->buffer_size) {
-        if (writer->buffer_size > SIZE_MAX / 2) {
-            perror("Buffer size to large, fatal error, exiting program.");
-            exit(1);
+// Appends len bytes, flushing only when the buffer is full. Blocks larger
+// than the whole buffer bypass it.
+static bool add_bytes_to_buffer(CSVWriter *writer, const char *data, size_t len) {
+    if (len > writer->buffer_size - writer->buffer_len && !writer->file) {
+        if (!grow_buffer(writer, len))
+            return false;
+    } else if (len > writer->buffer_size - writer->buffer_len) {
+#ifdef CSV_HAVE_PTHREADS
+        // Output must stay in queue order, so go through the buffers
+        while (writer->async && len > writer->buffer_size - writer->buffer_len) {
+            size_t space = writer->buffer_size - writer->buffer_len;
+            memcpy(writer->buffer + writer->buffer_len, data, space);
+            writer->buffer_len += space;
+            data += space;
+            len -= space;
+            if (!flush_buffer_to_file(writer))
+                return false;
         }
-        writer->buffer_size *= 2;
-        char *newBuffer = realloc(writer->buffer, writer->buffer_size);
-        if (!newBuffer)
+#endif
+        if (!flush_buffer_to_file(writer))
             return false;
-        writer->buffer = newBuffer;
+        if (len > writer->buffer_size) {
+            if (fwrite(data, 1, len, writer->file) != len) {
+                perror("Error writing buffer to file");
+                writer->io_error = true;
+                return false;
+            }
+            return true;
+        }
     }
-    writer->buffer[writer->buffer_len++] = c;
+    memcpy(writer->buffer + writer->buffer_len, data, len);
+    writer->buffer_len += len;
     return true;
 }
 
-static bool add_str_to_buffer(CSVWriter *writer, const char *str) {
-    while (*str) {
-        if (!add_to_buffer(writer, *str++)) {
+// For writers without a file (the parallel export's batch buffers): makes
+// room for extra more bytes instead of flushing
+static bool grow_buffer(CSVWriter *writer, size_t extra) {
+    if (extra <= writer->buffer_size - writer->buffer_len)
+        return true;
+    size_t new_size = writer->buffer_size;
+    while (extra > new_size - writer->buffer_len) {
+        if (new_size > SIZE_MAX / 2) {
+            fputs("Buffer size too large\n", stderr);
             return false;
         }
+        new_size *= 2;
+    }
+    char *new_buffer = realloc(writer->buffer, new_size);
+    if (!new_buffer) {
+        fputs("Failed to reallocate buffer\n", stderr);
+        return false;
+    }
+    writer->buffer = new_buffer;
+    writer->buffer_size = new_size;
+    return true;
+}
+
+static bool add_to_buffer(CSVWriter *writer, char c) {
+    if (writer->buffer_len >= writer->buffer_size) {
+        if (!flush_buffer_to_file(writer))
+            return false;
     }
+    writer->buffer[writer->buffer_len++] = c;
     return true;
 }
 
+// Fields without a quote, delimiter or line break are copied in one go.
+// The first CSV_WRITER_SCAN_MIN bytes are checked a byte at a time, which
+// also finds the length of short fields; the rest of a longer field goes
+// through the same vectorized scanner as parse_line. Quoted fields are
+// written as runs between quotes, each quote doubled.
 static bool add_field_to_buffer(CSVWriter *writer, const char *field,
                                 char delimiter) {
-    bool needs_quotes = false;
-    const char *c = field;
+    size_t special = scan_special_scalar(field, 0, CSV_WRITER_SCAN_MIN,
+                                         delimiter, '\n', '\r');
+    if (field[special] == '\0')
+        return add_bytes_to_buffer(writer, field, special);
+    size_t len = special + strlen(field + special);
+    if (special == CSV_WRITER_SCAN_MIN) {
+        special = scan_special(field, special, len, delimiter, false);
+        if (special == len)
+            return add_bytes_to_buffer(writer, field, len);
+    }
 
-    while (*c) {
-        if (*c == '"' || *c == delimiter || *c == '\n' || *c == '\r') {
-            needs_quotes = true;
-            break;
+    // A short field that fits is escaped straight into the buffer
+    if (len < CSV_WRITER_SCAN_MIN &&
+        2 * len + 2 <= writer->buffer_size - writer->buffer_len) {
+        char *out = writer->buffer + writer->buffer_len;
+        *out++ = '"';
+        for (size_t i = 0; i < len; i++) {
+            if (field[i] == '"')
+                *out++ = '"';
+            *out++ = field[i];
         }
-        ++c;
+        *out++ = '"';
+        writer->buffer_len = (size_t)(out - writer->buffer);
+        return true;
     }
 
-    c = field;
-
-    if (needs_quotes) {
-        if (!add_to_buffer(writer, '"'))
-            return false;
-        while (*c) {
-            if (*c == '"') {
-                if (!add_str_to_buffer(writer, "\"\""))
-                    return false;
-            } else {
-                if (!add_to_buffer(writer, *c))
-                    return false;
-            }
-            c++;
-        }
-        if (!add_to_buffer(writer, '"'))
+    if (!add_to_buffer(writer, '"'))
+        return false;
+    size_t pos = 0;
+    while (pos < len) {
+        size_t quote = scan_special(field, pos, len, delimiter, true);
+        if (!add_bytes_to_buffer(writer, field + pos, quote - pos))
             return false;
-    } else {
-        if (!add_str_to_buffer(writer, field))
+        if (quote == len)
+            break;
+        if (!add_bytes_to_buffer(writer, "\"\"", 2))
             return false;
+        pos = quote + 1;
     }
-
-    return true;
+    return add_to_buffer(writer, '"');
 }
 
-static CSVWriter *init_writer(FILE *file) {
-    CSVWriter *writer = malloc(sizeof(*writer));
+static CSVWriter *init_writer(FILE *file, char delimiter, size_t buffer_size) {
+    CSVWriter *writer = calloc(1, sizeof(*writer));
     if (!writer) {
         perror("failed to initialise csv writer");
         return NULL;
     }
-    writer->buffer = malloc(sizeof(char) * INITIAL_BUFFER_SIZE);
+    writer->buffer = malloc(sizeof(char) * buffer_size);
     if (!writer->buffer) {
         perror("failed to initialise csv writer buffer");
         destroy_writer(writer);
         return NULL;
     }
-    writer->buffer_size = INITIAL_BUFFER_SIZE;
+    writer->buffer_size = buffer_size;
     writer->buffer_len = 0;
     writer->file = file;
+    writer->delimiter = delimiter;
     return writer;
 }
 
 static void destroy_writer(CSVWriter *writer) {
+#ifdef CSV_HAVE_PTHREADS
+    if (writer->buffers) {
+        // buffer is one of the ring's buffers
+        for (size_t i = 0; i < writer->num_buffers; i++) {
+            free(writer->buffers[i]);
+        }
+        free(writer->buffers);
+        free(writer->lengths);
+        free(writer);
+        return;
+    }
+    free(writer->lengths);
+#endif
     free(writer->buffer);
     free(writer);
 }
 
-// TODO: ADD NULL CHECKS
-static bool write_csv_to_file(CSVWriter *writer, CSVParser *parser) {
-    for (size_t i = 0; i < parser->num_headers; i++) {
-        if (!add_str_to_buffer(writer, parser->headers[i]))
+static bool write_row_to_buffer(CSVWriter *writer, const char *const *fields,
+                                size_t num_fields) {
+    for (size_t j = 0; j < num_fields; j++) {
+        if (!add_field_to_buffer(writer, fields[j] ? fields[j] : "",
+                                 writer->delimiter))
             return false;
-        if (i < parser->num_headers - 1) {
-            if (!add_to_buffer(writer, parser->delimiter))
+        if (j < num_fields - 1) {
+            if (!add_to_buffer(writer, writer->delimiter))
                 return false;
         }
     }
-    if (!add_to_buffer(writer, '\n'))
+    return add_to_buffer(writer, '\n');
+}
+
+static bool write_csv_to_file(CSVWriter *writer, CSVParser *parser) {
+    if (!writer || !parser) {
+        fputs("Invalid writer or parser\n", stderr);
         return false;
-    if (!flush_buffer_to_file(writer))
+    }
+
+    if (parser->has_header &&
+        !write_row_to_buffer(writer, (const char *const *)parser->headers,
+                             parser->num_headers))
         return false;
-    ;
 
-    for (size_t i = 0; i < parser->num_rows; i++) {
-        for (size_t j = 0; j < parser->rows[i]->num_fields; j++) {
-            if (!add_field_to_buffer(writer, parser->rows[i]->fields[j],
-                                     parser->delimiter))
-                return false;
-            if (j < parser->rows[i]->num_fields - 1) {
-                if (!add_to_buffer(writer, parser->delimiter))
-                    return false;
+    // Columnar rows are gathered into one reusable pointer array
+    const char **row_fields = NULL;
+    if (parser->columnar && parser->num_columns > 0) {
+        row_fields = malloc(parser->num_columns * sizeof(char *));
+        if (!row_fields) {
+            fputs("Failed to allocate row buffer\n", stderr);
+            return false;
+        }
+    }
+
+    bool ok = write_parser_rows(writer, parser, 0, parser->num_rows, row_fields);
+    free(row_fields);
+    return ok && flush_buffer_to_file(writer);
+}
+
+// Writes rows [first, end). row_fields is scratch space for num_columns
+// pointers, needed only for columnar parsers.
+static bool write_parser_rows(CSVWriter *writer, CSVParser *parser, size_t first,
+                              size_t end, const char **row_fields) {
+    bool ok = true;
+    for (size_t i = first; ok && i < end; i++) {
+        if (parser->columnar) {
+            // Trailing missing columns are not written, like a short row
+            size_t num_fields = 0;
+            for (size_t j = 0; j < parser->num_columns; j++) {
+                row_fields[j] = csv_column_get(parser, j, i);
+                if (row_fields[j])
+                    num_fields = j + 1;
             }
+            ok = write_row_to_buffer(writer, row_fields, num_fields);
+        } else {
+            ok = write_row_to_buffer(writer,
+                                     (const char *const *)parser->rows[i]->fields,
+                                     parser->rows[i]->num_fields);
         }
-        if (!add_to_buffer(writer, '\n'))
-            return false;
-        if (i % 5 == 0) {
-            if (!flush_buffer_to_file(writer))
-                return false;
+    }
+    return ok;
+}
+
+#ifdef CSV_HAVE_PTHREADS
+static void *export_worker(void *arg) {
+    ExportJob *job = arg;
+    CSVParser *parser = job->parser;
+    // A writer without a file only accumulates, growing as needed
+    CSVWriter *batch = init_writer(NULL, job->delimiter, job->buffer_size);
+    const char **row_fields = NULL;
+    if (batch && parser->columnar && parser->num_columns > 0)
+        row_fields = malloc(parser->num_columns * sizeof(char *));
+    bool ok = batch && (!parser->columnar || parser->num_columns == 0 || row_fields);
+    if (!ok)
+        fputs("Failed to allocate export buffer\n", stderr);
+
+    pthread_mutex_lock(&job->lock);
+    if (!ok) {
+        job->failed = true;
+        pthread_cond_broadcast(&job->cond);
+    }
+    while (!job->failed && job->next_batch < job->num_batches) {
+        size_t index = job->next_batch++;
+        pthread_mutex_unlock(&job->lock);
+
+        size_t first = index * CSV_EXPORT_BATCH_ROWS;
+        size_t end = first + CSV_EXPORT_BATCH_ROWS;
+        if (end > parser->num_rows)
+            end = parser->num_rows;
+        batch->buffer_len = 0;
+        ok = write_parser_rows(batch, parser, first, end, row_fields);
+
+        // Offsets are handed out in batch order; only this step is serial
+        pthread_mutex_lock(&job->lock);
+        while (!job->failed && job->next_offset != index) {
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+        if (!ok || job->failed) {
+            job->failed = true;
+            pthread_cond_broadcast(&job->cond);
+            break;
+        }
+        off_t offset = job->offset;
+        job->offset += (off_t)batch->buffer_len;
+        ++job->next_offset;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+
+        size_t written = 0;
+        while (ok && written < batch->buffer_len) {
+            ssize_t n = pwrite(job->fd, batch->buffer + written,
+                               batch->buffer_len - written, offset + (off_t)written);
+            if (n < 0) {
+                perror("Error writing buffer to file");
+                ok = false;
+            } else {
+                written += (size_t)n;
+            }
+        }
+
+        pthread_mutex_lock(&job->lock);
+        if (!ok) {
+            job->failed = true;
+            pthread_cond_broadcast(&job->cond);
         }
     }
-    if (!flush_buffer_to_file(writer))
-        return false;
-    return true;
+    pthread_mutex_unlock(&job->lock);
+
+    free(row_fields);
+    if (batch)
+        destroy_writer(batch);
+    return NULL;
 }
+#endif
 
 #endif
@@ -0,0 +1,563 @@
+// Benchmarks for mbCsvParser.h. Build and run from this directory:
+//
+//   cc -O2 -std=c11 -pthread mbCsvParser_bench.c -o mbCsvParser_bench
+//   ./mbCsvParser_bench [size_mb] [suite...]
+//
+// Each suite generates its synthetic inputs or outputs of about size_mb
+// megabytes (default 16, 1 to 5000) as bench_*.csv in the current
+// directory and removes them afterwards. With no suite names every suite
+// runs. Times are the best of BENCH_RUNS runs.
+
+#define _DEFAULT_SOURCE
+#define CSV_ENABLE_STATS
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Heap allocator calls made by the parser, counted by wrapping the
+// header's malloc, calloc, realloc and strdup calls
+static size_t bench_allocations;
+#define malloc(size) (bench_allocations++, malloc(size))
+#define calloc(count, size) (bench_allocations++, calloc(count, size))
+#define realloc(ptr, size) (bench_allocations++, realloc(ptr, size))
+#define strdup(str) (bench_allocations++, strdup(str))
+#include "mbCsvParser.h"
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+
+#define BENCH_RUNS 3
+#define BENCH_INPUT "bench_input.csv"
+#define BENCH_OUTPUT "bench_output.csv"
+#define BENCH_WRITER_ROWS 1024
+
+typedef struct BenchShape {
+    size_t columns;
+    size_t field_len; // average field length, quotes excluded
+    bool quoted;      // quote every field, some with "" and delimiters inside
+    bool crlf;
+} BenchShape;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// xorshift, so inputs are the same on every run
+static uint32_t bench_random(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// Writes one field of about field_len bytes into out and returns its length
+static size_t make_field(char *out, size_t field_len, bool quoted,
+                         uint32_t *seed) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    size_t len = 1 + bench_random(seed) % (2 * field_len);
+    size_t n = 0;
+    if (quoted)
+        out[n++] = '"';
+    for (size_t i = 0; i < len; i++)
+        out[n++] = alphabet[bench_random(seed) % (sizeof(alphabet) - 1)];
+    if (quoted) {
+        if (bench_random(seed) % 4 == 0) {
+            memcpy(out + n, "\"\",x", 4);
+            n += 4;
+        }
+        out[n++] = '"';
+    }
+    return n;
+}
+
+// Writes a header and rows of the given shape until the file reaches
+// bytes; returns the number of data rows, or 0 on failure
+static size_t generate_csv(const char *path, const BenchShape *shape,
+                           size_t bytes) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        perror("Unable to create benchmark input");
+        return 0;
+    }
+    const char *eol = shape->crlf ? "\r\n" : "\n";
+    for (size_t col = 0; col < shape->columns; col++)
+        fprintf(file, "%scol%zu", col ? "," : "", col);
+    fputs(eol, file);
+
+    char *line = malloc(shape->columns * (2 * shape->field_len + 8) + 2);
+    if (!line) {
+        fclose(file);
+        return 0;
+    }
+    uint32_t seed = 2463534242u;
+    size_t written = 0;
+    size_t rows = 0;
+    while (written < bytes) {
+        size_t n = 0;
+        for (size_t col = 0; col < shape->columns; col++) {
+            if (col)
+                line[n++] = ',';
+            n += make_field(line + n, shape->field_len, shape->quoted, &seed);
+        }
+        memcpy(line + n, eol, strlen(eol));
+        n += strlen(eol);
+        if (fwrite(line, 1, n, file) != n)
+            break;
+        written += n;
+        rows++;
+    }
+    free(line);
+    if (fclose(file) != 0 || written < bytes) {
+        perror("Unable to write benchmark input");
+        return 0;
+    }
+    return rows;
+}
+
+// Fills fields with rows * columns raw values for the writer suites, all
+// NUL-terminated in one block; quote_heavy puts a quote, delimiter or
+// newline in about every fourth byte. Returns the block, or NULL.
+static char *make_values(const char **fields, size_t rows, size_t columns,
+                         size_t field_len, bool quote_heavy) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    static const char specials[] = "\"\",\n";
+    char *block = malloc(rows * columns * (2 * field_len + 1));
+    if (!block)
+        return NULL;
+    uint32_t seed = 88675123u;
+    char *out = block;
+    for (size_t i = 0; i < rows * columns; i++) {
+        fields[i] = out;
+        size_t len = 1 + bench_random(&seed) % (2 * field_len);
+        for (size_t j = 0; j < len; j++) {
+            uint32_t r = bench_random(&seed);
+            *out++ = quote_heavy && r % 4 == 0
+                         ? specials[(r >> 8) % (sizeof(specials) - 1)]
+                         : alphabet[(r >> 8) % (sizeof(alphabet) - 1)];
+        }
+        *out++ = '\0';
+    }
+    return block;
+}
+
+static size_t file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (size_t)st.st_size : 0;
+}
+
+// prints one result line; the caller ends it
+static void report(const char *name, double seconds, size_t bytes,
+                   size_t rows) {
+    printf("  %-28s %9.1f MB/s %12.0f rows/s", name,
+           (double)bytes / 1e6 / seconds, (double)rows / seconds);
+}
+
+// csv_parser_parse_file over every combination of narrow/wide,
+// unquoted/quoted and LF/CRLF, with the read/parse split from the stats
+static void bench_parse(size_t bytes) {
+    puts("parse: csv_parser_parse_file");
+    for (int i = 0; i < 8; i++) {
+        BenchShape shape = {.columns = i & 1 ? 64 : 8,
+                            .field_len = i & 1 ? 12 : 6,
+                            .quoted = (i & 2) != 0,
+                            .crlf = (i & 4) != 0};
+        size_t rows = generate_csv(BENCH_INPUT, &shape, bytes);
+        if (!rows)
+            return;
+        char name[64];
+        snprintf(name, sizeof(name), "%s %s %s", i & 1 ? "wide" : "narrow",
+                 shape.quoted ? "quoted" : "unquoted",
+                 shape.crlf ? "CRLF" : "LF");
+
+        double best = 0;
+        CSVStats stats = {0};
+        for (int run = 0; run < BENCH_RUNS; run++) {
+            CSVParser *parser = csv_parser_create(',', true);
+            double start = now_seconds();
+            bool ok = csv_parser_parse_file(parser, BENCH_INPUT);
+            double elapsed = now_seconds() - start;
+            stats = csv_parser_get_stats(parser);
+            csv_parser_destroy(parser);
+            if (!ok) {
+                fputs("Benchmark parse failed\n", stderr);
+                remove(BENCH_INPUT);
+                return;
+            }
+            if (run == 0 || elapsed < best)
+                best = elapsed;
+        }
+        report(name, best, bytes, rows);
+        printf("   read %.0f%% of the time\n",
+               100 * stats.read_seconds /
+                   (stats.read_seconds + stats.parse_seconds));
+    }
+    remove(BENCH_INPUT);
+}
+
+// Parse entry points for time_parse; arg is the thread count where one
+// is taken
+typedef bool (*BenchParse)(CSVParser *parser, const char *path, size_t arg);
+
+static bool bench_parse_file(CSVParser *parser, const char *path,
+                             size_t arg) {
+    (void)arg;
+    return csv_parser_parse_file(parser, path);
+}
+
+static bool bench_parse_parallel(CSVParser *parser, const char *path,
+                                 size_t num_threads) {
+    return csv_parser_parse_file_parallel(parser, path, num_threads);
+}
+
+static bool skip_row(const CSVRow *row, void *user_ctx) {
+    (void)row;
+    (void)user_ctx;
+    return true;
+}
+
+static bool bench_parse_stream(CSVParser *parser, const char *path,
+                               size_t arg) {
+    (void)arg;
+    return csv_parser_stream_file(parser, path, skip_row, NULL);
+}
+
+static bool bench_parse_map(CSVParser *parser, const char *path, size_t arg) {
+    (void)arg;
+    return csv_parser_map_file(parser, path);
+}
+
+// Best time of parse over BENCH_INPUT, destroy excluded; 0 on failure
+static double time_parse(BenchParse parse, size_t arg) {
+    double best = 0;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        CSVParser *parser = csv_parser_create(',', true);
+        double start = now_seconds();
+        bool ok = parse(parser, BENCH_INPUT, arg);
+        double elapsed = now_seconds() - start;
+        csv_parser_destroy(parser);
+        if (!ok) {
+            fputs("Benchmark parse failed\n", stderr);
+            return 0;
+        }
+        if (run == 0 || elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+// csv_parser_parse_file_parallel on 1, 2 and 4 threads
+static void bench_parallel(size_t bytes) {
+    static const size_t thread_counts[] = {1, 2, 4};
+    puts("parallel: csv_parser_parse_file_parallel");
+    for (int i = 0; i < 2; i++) {
+        BenchShape shape = {.columns = i ? 64 : 8, .field_len = i ? 12 : 6};
+        size_t rows = generate_csv(BENCH_INPUT, &shape, bytes);
+        if (!rows)
+            return;
+        for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]);
+             t++) {
+            double best = time_parse(bench_parse_parallel, thread_counts[t]);
+            if (best == 0)
+                break;
+            char name[64];
+            snprintf(name, sizeof(name), "%s, %zu thread%s",
+                     i ? "wide" : "narrow", thread_counts[t],
+                     thread_counts[t] > 1 ? "s" : "");
+            report(name, best, bytes, rows);
+            putchar('\n');
+        }
+    }
+    remove(BENCH_INPUT);
+}
+
+// parse against csv_parser_parse_file on narrow/wide, unquoted/quoted
+// inputs
+static void bench_against_file(size_t bytes, const char *label,
+                               BenchParse parse) {
+    for (int i = 0; i < 4; i++) {
+        BenchShape shape = {.columns = i & 1 ? 64 : 8,
+                            .field_len = i & 1 ? 12 : 6,
+                            .quoted = (i & 2) != 0};
+        size_t rows = generate_csv(BENCH_INPUT, &shape, bytes);
+        if (!rows)
+            return;
+        for (int j = 0; j < 2; j++) {
+            double best = time_parse(j ? parse : bench_parse_file, 0);
+            if (best == 0)
+                break;
+            char name[64];
+            snprintf(name, sizeof(name), "%s %s %s", i & 1 ? "wide" : "narrow",
+                     shape.quoted ? "quoted" : "unquoted",
+                     j ? label : "parse_file");
+            report(name, best, bytes, rows);
+            putchar('\n');
+        }
+    }
+    remove(BENCH_INPUT);
+}
+
+// csv_parser_stream_file with a callback that keeps nothing
+static void bench_stream(size_t bytes) {
+    puts("stream: csv_parser_stream_file vs csv_parser_parse_file");
+    bench_against_file(bytes, "stream", bench_parse_stream);
+}
+
+// csv_parser_map_file, fields left as views into the mapping
+static void bench_map(size_t bytes) {
+    puts("map: csv_parser_map_file vs csv_parser_parse_file");
+    bench_against_file(bytes, "map", bench_parse_map);
+}
+
+// Heap allocations and parse/destroy wall time with per-row and per-field
+// malloc against the arena (csv_parser_set_arena)
+static void bench_arena(size_t bytes) {
+    puts("arena: malloc per row and field vs csv_parser_set_arena");
+    for (int i = 0; i < 2; i++) {
+        BenchShape shape = {.columns = i ? 64 : 8, .field_len = i ? 12 : 6};
+        size_t rows = generate_csv(BENCH_INPUT, &shape, bytes);
+        if (!rows)
+            return;
+        for (int arena = 0; arena < 2; arena++) {
+            double best_parse = 0;
+            double best_destroy = 0;
+            size_t allocations = 0;
+            for (int run = 0; run < BENCH_RUNS; run++) {
+                bench_allocations = 0;
+                CSVParser *parser = csv_parser_create(',', true);
+                csv_parser_set_arena(parser, arena);
+                double start = now_seconds();
+                bool ok = csv_parser_parse_file(parser, BENCH_INPUT);
+                double parsed = now_seconds();
+                allocations = bench_allocations;
+                csv_parser_destroy(parser);
+                double destroyed = now_seconds();
+                if (!ok) {
+                    fputs("Benchmark parse failed\n", stderr);
+                    remove(BENCH_INPUT);
+                    return;
+                }
+                if (run == 0 || parsed - start < best_parse)
+                    best_parse = parsed - start;
+                if (run == 0 || destroyed - parsed < best_destroy)
+                    best_destroy = destroyed - parsed;
+            }
+            char name[64];
+            snprintf(name, sizeof(name), "%s %s", i ? "wide" : "narrow",
+                     arena ? "arena" : "malloc");
+            report(name, best_parse, bytes, rows);
+            printf(" %10zu allocs, destroy %.1f ms\n", allocations,
+                   best_destroy * 1e3);
+        }
+    }
+    remove(BENCH_INPUT);
+}
+
+// Field length: short fields stay in parse_line's inline buffer, which is
+// the case that must not regress; long ones spill past
+// CSV_INLINE_FIELD_LEN into the reused heap buffer
+static void bench_fields(size_t bytes) {
+    static const size_t lengths[] = {4, 64, 2 * CSV_INLINE_FIELD_LEN, 4096};
+    puts("fields: short (inline) vs long (spilled) fields");
+    for (size_t i = 0; i < 2 * sizeof(lengths) / sizeof(lengths[0]); i++) {
+        BenchShape shape = {.columns = 8,
+                            .field_len = lengths[i / 2],
+                            .quoted = i % 2};
+        size_t rows = generate_csv(BENCH_INPUT, &shape, bytes);
+        if (!rows)
+            return;
+        double best = 0;
+        for (int run = 0; run < BENCH_RUNS; run++) {
+            CSVParser *parser = csv_parser_create(',', true);
+            double start = now_seconds();
+            bool ok = csv_parser_parse_file(parser, BENCH_INPUT);
+            double elapsed = now_seconds() - start;
+            csv_parser_destroy(parser);
+            if (!ok) {
+                fputs("Benchmark parse failed\n", stderr);
+                remove(BENCH_INPUT);
+                return;
+            }
+            if (run == 0 || elapsed < best)
+                best = elapsed;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "~%zu byte fields %s", shape.field_len,
+                 shape.quoted ? "quoted" : "unquoted");
+        report(name, best, bytes, rows);
+        putchar('\n');
+    }
+    remove(BENCH_INPUT);
+}
+
+// csv_writer_write_row on narrow, wide, quote-heavy and long-field rows
+// until the output reaches bytes, close included
+static void bench_writer(size_t bytes) {
+    static const struct {
+        const char *name;
+        size_t columns;
+        size_t field_len;
+        bool quote_heavy;
+    } datasets[] = {
+        {"narrow", 8, 6, false},
+        {"wide", 64, 12, false},
+        {"quote-heavy", 8, 16, true},
+        {"long fields", 8, 256, false},
+    };
+    puts("writer: csv_writer_write_row");
+    for (size_t d = 0; d < sizeof(datasets) / sizeof(datasets[0]); d++) {
+        size_t columns = datasets[d].columns;
+        const char **fields = malloc(BENCH_WRITER_ROWS * columns * sizeof(char *));
+        char *values = fields ? make_values(fields, BENCH_WRITER_ROWS, columns,
+                                            datasets[d].field_len,
+                                            datasets[d].quote_heavy)
+                              : NULL;
+        if (!values) {
+            fputs("Failed to allocate benchmark rows\n", stderr);
+            free(fields);
+            return;
+        }
+        // one pass over the rows writes about this many bytes
+        size_t pass_bytes = 0;
+        for (size_t i = 0; i < BENCH_WRITER_ROWS * columns; i++)
+            pass_bytes += strlen(fields[i]) + 1;
+
+        double best = 0;
+        size_t rows = 0;
+        for (int run = 0; run < BENCH_RUNS; run++) {
+            double start = now_seconds();
+            CSVWriter *writer = csv_writer_open(BENCH_OUTPUT, ',', 0);
+            bool ok = writer != NULL;
+            rows = 0;
+            for (size_t written = 0; ok && written < bytes;
+                 written += pass_bytes) {
+                for (size_t r = 0; ok && r < BENCH_WRITER_ROWS; r++)
+                    ok = csv_writer_write_row(writer, fields + r * columns,
+                                              columns);
+                rows += BENCH_WRITER_ROWS;
+            }
+            ok = writer && csv_writer_close(writer) && ok;
+            double elapsed = now_seconds() - start;
+            if (!ok) {
+                fputs("Benchmark write failed\n", stderr);
+                break;
+            }
+            if (run == 0 || elapsed < best)
+                best = elapsed;
+        }
+        if (best > 0) {
+            report(datasets[d].name, best, file_size(BENCH_OUTPUT), rows);
+            putchar('\n');
+        }
+        free(values);
+        free(fields);
+    }
+    remove(BENCH_OUTPUT);
+}
+
+// csv_writer_write_parser through the synchronous writer and through
+// csv_writer_open_async with 2 and 4 buffers, close included
+static void bench_async(size_t bytes) {
+    puts("async: csv_writer_write_parser, sync vs async writer");
+    BenchShape shape = {.columns = 16, .field_len = 8, .quoted = true};
+    size_t rows = generate_csv(BENCH_INPUT, &shape, bytes);
+    if (!rows)
+        return;
+    CSVParser *parser = csv_parser_create(',', true);
+    csv_parser_set_arena(parser, true);
+    bool parsed = csv_parser_parse_file(parser, BENCH_INPUT);
+    remove(BENCH_INPUT);
+    if (!parsed) {
+        fputs("Benchmark parse failed\n", stderr);
+        csv_parser_destroy(parser);
+        return;
+    }
+
+    static const size_t buffer_counts[] = {0, 2, 4};
+    for (size_t i = 0; i < sizeof(buffer_counts) / sizeof(buffer_counts[0]);
+         i++) {
+        double best = 0;
+        for (int run = 0; run < BENCH_RUNS; run++) {
+            double start = now_seconds();
+            CSVWriter *writer =
+                buffer_counts[i]
+                    ? csv_writer_open_async(BENCH_OUTPUT, ',', 0,
+                                            buffer_counts[i])
+                    : csv_writer_open(BENCH_OUTPUT, ',', 0);
+            bool ok = writer && csv_writer_write_parser(writer, parser);
+            ok = writer && csv_writer_close(writer) && ok;
+            double elapsed = now_seconds() - start;
+            if (!ok) {
+                fputs("Benchmark write failed\n", stderr);
+                best = 0;
+                break;
+            }
+            if (run == 0 || elapsed < best)
+                best = elapsed;
+        }
+        if (best > 0) {
+            char name[64];
+            if (buffer_counts[i])
+                snprintf(name, sizeof(name), "async, %zu buffers",
+                         buffer_counts[i]);
+            else
+                snprintf(name, sizeof(name), "sync");
+            report(name, best, file_size(BENCH_OUTPUT), rows);
+            putchar('\n');
+        }
+    }
+    remove(BENCH_OUTPUT);
+    csv_parser_destroy(parser);
+}
+
+typedef struct BenchSuite {
+    const char *name;
+    void (*run)(size_t bytes);
+} BenchSuite;
+
+static const BenchSuite suites[] = {
+    {"parse", bench_parse},
+    {"parallel", bench_parallel},
+    {"stream", bench_stream},
+    {"map", bench_map},
+    {"arena", bench_arena},
+    {"fields", bench_fields},
+    {"writer", bench_writer},
+    {"async", bench_async},
+};
+
+int main(int argc, char **argv) {
+    size_t size_mb = 16;
+    int first_suite = 1;
+    if (argc > 1 && argv[1][0] >= '0' && argv[1][0] <= '9') {
+        size_mb = strtoul(argv[1], NULL, 10);
+        first_suite = 2;
+    }
+    if (size_mb < 1 || size_mb > 5000) {
+        fputs("size_mb must be between 1 and 5000\n", stderr);
+        return 1;
+    }
+    size_t num_suites = sizeof(suites) / sizeof(suites[0]);
+    for (int arg = first_suite; arg < argc; arg++) {
+        size_t i = 0;
+        while (i < num_suites && strcmp(argv[arg], suites[i].name) != 0)
+            i++;
+        if (i == num_suites) {
+            fprintf(stderr, "Unknown suite %s\n", argv[arg]);
+            return 1;
+        }
+    }
+
+    printf("%zu MB inputs, best of %d runs\n", size_mb, BENCH_RUNS);
+    for (size_t i = 0; i < num_suites; i++) {
+        bool selected = first_suite >= argc;
+        for (int arg = first_suite; arg < argc; arg++)
+            selected = selected || strcmp(argv[arg], suites[i].name) == 0;
+        if (selected)
+            suites[i].run(size_mb * 1000 * 1000);
+    }
+    return 0;
+}
@@ -1,8 +1,1146 @@
-﻿// learn_cpp_bitmap_2025.h : Include file for standard system include files,
-// or project specific include files.
+﻿// learn_cpp_bitmap_2025.h : PixArr, Bitmap and BitmapWriter, shared by the
+// program and the benchmarks.
 
 #pragma once
 
-#include <iostream>
+#include <cstdint>
+#include <memory>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <string>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
-// TODO: Reference additional headers your program requires here.
+#ifdef _WIN32
+#include <fstream>
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define BITMAP_HAVE_SSE2
+#endif
+
+using std::uint16_t;
+using std::uint32_t;
+using std::uint8_t;
+
+inline void putLE16(uint8_t* dst, uint16_t value) {
+	dst[0] = static_cast<uint8_t>(value);
+	dst[1] = static_cast<uint8_t>(value >> 8);
+}
+
+inline void putLE32(uint8_t* dst, uint32_t value) {
+	for (int i = 0; i < 4; i++)
+		dst[i] = static_cast<uint8_t>(value >> (8 * i));
+}
+
+inline uint16_t getLE16(const uint8_t* src) {
+	return static_cast<uint16_t>(src[0] | src[1] << 8);
+}
+
+inline uint32_t getLE32(const uint8_t* src) {
+	uint32_t value = 0;
+	for (int i = 0; i < 4; i++)
+		value |= static_cast<uint32_t>(src[i]) << (8 * i);
+	return value;
+}
+
+// The BMP file and image size fields are 32-bit; larger sizes are written
+// as 0, which readers accept for uncompressed images
+inline uint32_t headerSize(uint64_t size) {
+	return size > UINT32_MAX ? 0 : static_cast<uint32_t>(size);
+}
+
+// Maps the whole of an existing file read/write and shared, so writes to
+// the mapping reach the file. Throws std::system_error on failure.
+inline uint8_t* mapFile(const std::string& path, size_t& size) {
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+		nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		throw std::system_error(GetLastError(), std::system_category(), "unable to open " + path);
+	LARGE_INTEGER file_size;
+	HANDLE mapping = nullptr;
+	void* view = nullptr;
+	if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+	if (mapping)
+		view = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0);
+	DWORD err = GetLastError();
+	// the view keeps the file and mapping alive
+	if (mapping)
+		CloseHandle(mapping);
+	CloseHandle(file);
+	if (!view)
+		throw std::system_error(err, std::system_category(), "unable to map " + path);
+	size = static_cast<size_t>(file_size.QuadPart);
+	return static_cast<uint8_t*>(view);
+#else
+	int fd = open(path.c_str(), O_RDWR);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category(), "unable to open " + path);
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		close(fd);
+		throw std::system_error(err, std::generic_category(), "unable to stat " + path);
+	}
+	void* map = st.st_size > 0 ?
+		mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) :
+		MAP_FAILED;
+	int err = st.st_size > 0 ? errno : EINVAL;
+	close(fd);
+	if (map == MAP_FAILED)
+		throw std::system_error(err, std::generic_category(), "unable to map " + path);
+	size = static_cast<size_t>(st.st_size);
+	return static_cast<uint8_t*>(map);
+#endif
+}
+
+inline void unmapFile(void* base, size_t size) {
+#ifdef _WIN32
+	(void)size;
+	UnmapViewOfFile(base);
+#else
+	munmap(base, size);
+#endif
+}
+
+// writes a mapping's dirty pages back to its file
+inline void syncFile(void* base, size_t size) {
+#ifdef _WIN32
+	if (!FlushViewOfFile(base, size))
+		throw std::system_error(GetLastError(), std::system_category(), "unable to sync mapped file");
+#else
+	if (msync(base, size, MS_SYNC) != 0)
+		throw std::system_error(errno, std::generic_category(), "unable to sync mapped file");
+#endif
+}
+
+
+// Pixel storage for one of the BMP bit depths: 1, 4 and 8bpp hold palette
+// indices (1 and 4bpp packed most significant bits first), 24 and 32bpp
+// hold colours as 0xRRGGBB / 0xAARRGGBB, stored blue first. Rows are
+// stored bottom-up and padded to a multiple of 4 bytes.
+template <uint16_t BitsPerPix>
+class PixArr {
+	static_assert(BitsPerPix == 1 || BitsPerPix == 4 || BitsPerPix == 8 ||
+		BitsPerPix == 24 || BitsPerPix == 32, "supported bit depths are 1, 4, 8, 24 and 32");
+
+public:
+	static constexpr bool indexed = BitsPerPix <= 8;
+	using value_type = std::conditional_t<indexed, uint8_t, uint32_t>;
+
+	// bytes per row including padding, and without it; throws
+	// std::length_error for negative widths and rows that need more than
+	// 32 bits
+	static constexpr uint32_t rowStride(int32_t image_width) {
+		return checkRowSize((rowBits(image_width) + 31) / 32 * 4);
+	}
+
+	static constexpr uint32_t rowBytes(int32_t image_width) {
+		return checkRowSize((rowBits(image_width) + 7) / 8);
+	}
+
+	// bytes in the whole pixel array; cannot overflow as the stride fits
+	// in 32 bits and the height in 31
+	static constexpr uint64_t imageBytes(int32_t image_width, int32_t image_height) {
+		if (image_height < 0)
+			throw std::length_error("negative bitmap height");
+		return static_cast<uint64_t>(rowStride(image_width)) * static_cast<uint32_t>(image_height);
+	}
+
+	// the pixel array starts on a cache line, so whole lines can be handed
+	// to different threads
+	static constexpr size_t cache_line = 64;
+
+private:
+	static constexpr uint64_t rowBits(int32_t image_width) {
+		if (image_width < 0)
+			throw std::length_error("negative bitmap width");
+		return static_cast<uint64_t>(image_width) * BitsPerPix;
+	}
+
+	static constexpr uint32_t checkRowSize(uint64_t bytes) {
+		if (bytes > UINT32_MAX)
+			throw std::length_error("bitmap row does not fit in 32 bits");
+		return static_cast<uint32_t>(bytes);
+	}
+
+	// frees the aligned allocation, or unmaps the file the pixels live in
+	struct Release {
+		void* map_base = nullptr;
+		size_t map_size = 0;
+
+		void operator()(uint8_t* pix) const {
+			if (map_base)
+				unmapFile(map_base, map_size);
+			else
+				::operator delete[](pix, std::align_val_t(cache_line));
+		}
+	};
+
+	std::unique_ptr<uint8_t[], Release> m_pix_arr;
+	int32_t m_image_width;
+	int32_t m_image_height;
+	uint32_t m_row_stride;
+	uint16_t m_padding;
+
+public:
+	PixArr(int32_t image_width, int32_t image_height) :
+		m_image_width(image_width), m_image_height(image_height),
+		m_row_stride(rowStride(image_width)) {
+		m_padding = static_cast<uint16_t>(m_row_stride - rowBytes(image_width));
+		const uint64_t bytes = imageBytes(image_width, image_height);
+		if constexpr (sizeof(size_t) < sizeof(uint64_t)) {
+			if (bytes > SIZE_MAX)
+				throw std::length_error("bitmap does not fit in the address space");
+		}
+		size_t size = static_cast<size_t>(bytes);
+		m_pix_arr.reset(static_cast<uint8_t*>(::operator new[](size, std::align_val_t(cache_line))));
+		std::memset(m_pix_arr.get(), 0, size);
+	}
+
+	// uses pixels inside a file mapping of map_size bytes at map_base in
+	// place; the mapping is released with the PixArr
+	PixArr(int32_t image_width, int32_t image_height, uint8_t* pixels,
+		void* map_base, size_t map_size) :
+		m_pix_arr(pixels, Release{ map_base, map_size }),
+		m_image_width(image_width), m_image_height(image_height),
+		m_row_stride(rowStride(image_width)) {
+		m_padding = static_cast<uint16_t>(m_row_stride - rowBytes(image_width));
+	}
+
+	inline bool isMapped() {
+		return m_pix_arr.get_deleter().map_base != nullptr;
+	}
+
+	// flushes edits to a mapped pixel array back to its file
+	void sync() {
+		const Release& mapping = m_pix_arr.get_deleter();
+		if (mapping.map_base)
+			syncFile(mapping.map_base, mapping.map_size);
+	}
+
+	inline uint32_t getRowStride() {
+		return m_row_stride;
+	}
+
+	inline uint64_t getByteSize() {
+		return static_cast<uint64_t>(m_row_stride) * m_image_height;
+	}
+
+	inline int32_t getImageWidth() {
+		return m_image_width;
+	}
+
+	inline int32_t getImageHeight() {
+		return m_image_height;
+	}
+
+	// rows are stored bottom-up with their padding, exactly as in the file
+	inline const uint8_t* getData() {
+		return m_pix_arr.get();
+	}
+
+	// start of row y (0 = bottom); rows are getRowStride() bytes apart
+	inline uint8_t* getRow(int32_t y) {
+		return m_pix_arr.get() + static_cast<size_t>(m_row_stride) * y;
+	}
+
+	static inline void InternalSetPixel(uint8_t* row, const uint32_t x, const value_type colour) {
+		if constexpr (BitsPerPix == 8) {
+			row[x] = colour;
+		}
+		else if constexpr (BitsPerPix < 8) {
+			constexpr uint32_t per_byte = 8 / BitsPerPix;
+			constexpr uint8_t mask = (1u << BitsPerPix) - 1;
+			const uint32_t shift = (per_byte - 1 - x % per_byte) * BitsPerPix;
+			uint8_t& byte = row[x / per_byte];
+			byte = static_cast<uint8_t>((byte & ~(mask << shift)) | ((colour & mask) << shift));
+		}
+		else {
+			uint8_t* pix = row + x * (BitsPerPix / 8);
+			for (uint32_t i = 0; i < BitsPerPix / 8; i++)
+				pix[i] = static_cast<uint8_t>(colour >> (8 * i));
+		}
+	}
+
+	static inline value_type InternalGetPixel(const uint8_t* row, const uint32_t x) {
+		if constexpr (BitsPerPix == 8) {
+			return row[x];
+		}
+		else if constexpr (BitsPerPix < 8) {
+			constexpr uint32_t per_byte = 8 / BitsPerPix;
+			constexpr uint8_t mask = (1u << BitsPerPix) - 1;
+			const uint32_t shift = (per_byte - 1 - x % per_byte) * BitsPerPix;
+			return static_cast<uint8_t>((row[x / per_byte] >> shift) & mask);
+		}
+		else {
+			const uint8_t* pix = row + x * (BitsPerPix / 8);
+			uint32_t colour = 0;
+			for (uint32_t i = 0; i < BitsPerPix / 8; i++)
+				colour |= static_cast<uint32_t>(pix[i]) << (8 * i);
+			return colour;
+		}
+	}
+};
+
+
+// BITMAPINFOHEADER bitmap of 1, 4, 8 (the default), 24 or 32 bits per
+// pixel. Layout, palette size and header offsets are fixed at compile time
+// and pixel access is specialised per depth.
+template <uint16_t BitsPerPix = 8>
+class Bitmap {
+public:
+	using Pixels = PixArr<BitsPerPix>;
+	using value_type = typename Pixels::value_type;
+
+private:
+	const char* sig{ "BM" };
+
+	// File header
+	uint32_t m_file_size;
+	
+	// THE TWO BELOW ARE PART OF FILEHEADER BUT DON'T NEED TO BE STORED
+	// uint16_t m_reserved_1;
+	// uint16_t m_reserved_2;
+	
+	uint32_t m_pix_arr_offset;
+
+	// DIB header (BITMAPINFOHEADER)
+	uint32_t m_dib_header_size;
+
+	// THE TWO BELOW ARE STORED IN PixArr OBJECT
+	// int32_t m_image_width;
+	// int32_t m_image_height;
+
+	uint16_t m_colour_planes;
+	static constexpr uint16_t m_bits_per_pix = BitsPerPix;
+	uint32_t m_compress_type;
+	uint32_t m_image_size;
+	uint32_t m_horizontal_res;
+	uint32_t m_vertical_res;
+	uint32_t m_palette_colours;
+	uint32_t m_important_colours;
+
+	// Colour table (empty for 24 and 32bpp)
+	std::unique_ptr<uint8_t[]> m_palette;
+
+	// Pixel Array, either owned or inside the file mapping from open()
+	Pixels m_pix_arr;
+
+	// target size of one render() band, small enough to stay in cache
+	static constexpr size_t render_band_bytes = 64 * 1024;
+
+public:
+
+	// This is a default constructor that assumes many parameters
+	// -> horizontal and vertical res = 20 pixels/m
+	// -> full palette for 1, 4 and 8bpp
+	// -> grayscale palette, black to white
+	// and more
+	Bitmap(int32_t image_width, int32_t image_height) :
+		Bitmap(Pixels(image_width, image_height)) {
+
+		// file_header_size = 14
+		// dib_header_size = 40
+		m_pix_arr_offset = 14 + 40 + getPaletteSize();
+		m_image_size = headerSize(m_pix_arr.getByteSize());
+		m_file_size = headerSize(m_pix_arr_offset + m_pix_arr.getByteSize());
+
+		fillPalette(m_palette.get());
+	}
+
+	// Maps an existing uncompressed, bottom-up BMP of this bit depth and
+	// edits it in place: the pixel array is used straight from the mapping,
+	// so opening costs the same whatever the image size, and setPixel, the
+	// bulk operations and render() change the file itself. save() flushes
+	// the changes to disk. The palette is copied. Throws std::system_error
+	// if the file cannot be mapped and std::runtime_error if its headers
+	// do not describe such an image.
+	static Bitmap open(const std::string& path) {
+		size_t size = 0;
+		uint8_t* base = mapFile(path, size);
+		const uint8_t* dib = base + 14;
+		int32_t width = 0;
+		int32_t height = 0;
+		uint32_t pix_arr_offset = 0;
+		uint32_t dib_header_size = 0;
+		uint32_t palette_colours = 0;
+		uint32_t stored_colours = 0;
+		try {
+			auto invalid = [&path](const std::string& why) {
+				return std::runtime_error(path + ": " + why);
+			};
+			if (size < 14 + 40 || base[0] != 'B' || base[1] != 'M')
+				throw invalid("not a BMP file");
+
+			pix_arr_offset = getLE32(base + 10);
+			dib_header_size = getLE32(dib);
+			width = static_cast<int32_t>(getLE32(dib + 4));
+			height = static_cast<int32_t>(getLE32(dib + 8));
+			palette_colours = getLE32(dib + 32);
+			if (dib_header_size < 40 || dib_header_size > size - 14)
+				throw invalid("unsupported DIB header");
+			if (getLE16(dib + 14) != BitsPerPix)
+				throw invalid("expected " + std::to_string(BitsPerPix) + " bits per pixel, got " +
+					std::to_string(getLE16(dib + 14)));
+			if (getLE32(dib + 16) != 0)
+				throw invalid("compressed images cannot be edited in place");
+			if (width <= 0 || height <= 0)
+				throw invalid("only bottom-up images with a positive size are supported");
+			if ((static_cast<uint64_t>(width) * BitsPerPix + 31) / 32 * 4 > UINT32_MAX)
+				throw invalid("row size does not fit in 32 bits");
+
+			// the palette and pixel array must both lie inside the file
+			const uint64_t image_size = Pixels::imageBytes(width, height);
+			stored_colours = palette_colours ? palette_colours : getNumPaletteColours();
+			const uint64_t palette_end = 14 + static_cast<uint64_t>(dib_header_size) +
+				(Pixels::indexed ? stored_colours * 4ull : 0);
+			if (Pixels::indexed && palette_colours > getNumPaletteColours())
+				throw invalid("palette too large");
+			if (palette_end > pix_arr_offset || pix_arr_offset > size ||
+				image_size > size - pix_arr_offset)
+				throw invalid("pixel array offset or size does not fit the file");
+			const uint32_t stored_image_size = getLE32(dib + 20);
+			if (stored_image_size != 0 && stored_image_size < image_size)
+				throw invalid("image size field is smaller than the pixel array");
+		}
+		catch (...) {
+			// nothing owns the mapping until the Pixels below is built
+			unmapFile(base, size);
+			throw;
+		}
+
+		// from here the Pixels owns the mapping and releases it if anything
+		// else throws
+		Bitmap bitmap(Pixels(width, height, base + pix_arr_offset, base, size));
+		bitmap.m_file_size = getLE32(base + 2);
+		bitmap.m_pix_arr_offset = pix_arr_offset;
+		bitmap.m_dib_header_size = dib_header_size;
+		bitmap.m_colour_planes = getLE16(dib + 12);
+		bitmap.m_compress_type = 0;
+		bitmap.m_image_size = getLE32(dib + 20);
+		bitmap.m_horizontal_res = getLE32(dib + 24);
+		bitmap.m_vertical_res = getLE32(dib + 28);
+		bitmap.m_palette_colours = palette_colours;
+		bitmap.m_important_colours = getLE32(dib + 36);
+		if constexpr (Pixels::indexed)
+			std::memcpy(bitmap.m_palette.get(), base + 14 + dib_header_size, stored_colours * 4);
+		return bitmap;
+	}
+
+	// writes the getPaletteSize() byte greyscale colour table
+	static void fillPalette(uint8_t* palette) {
+		constexpr uint32_t num_colours = getNumPaletteColours();
+		for (uint32_t i = 0; i < num_colours; i++) {
+			uint32_t offset = i * 4;
+			uint8_t grey = static_cast<uint8_t>(i * 255 / (num_colours - 1));
+			palette[offset] = grey; // Blue
+			palette[offset + 1] = grey; // Green
+			palette[offset + 2] = grey; // Red
+			palette[offset + 3] = 0; // Reserved
+		}
+	}
+
+	inline int32_t getImageWidth() {
+		return m_pix_arr.getImageWidth();
+	}
+
+	inline int32_t getImageHeight() {
+		return m_pix_arr.getImageHeight();
+	}
+
+	// raw pixel rows, bottom-up, getRowStride() bytes apart
+	inline const uint8_t* getData() {
+		return m_pix_arr.getData();
+	}
+
+	inline uint32_t getRowStride() {
+		return m_pix_arr.getRowStride();
+	}
+
+	static constexpr uint32_t getNumPaletteColours() {
+		return Pixels::indexed ? 1u << BitsPerPix : 0;
+	}
+
+	static constexpr uint32_t getPaletteSize() {
+		return getNumPaletteColours() * 4;
+	}
+
+	// returns index of the greyscale palette given percent input
+	// where input 100.0 is white and 0.0 is black
+	inline uint32_t grayScalePrctToIndex(float percentage) requires Pixels::indexed {
+		if (percentage < 0.0) percentage = 0.0;
+		if (percentage > 100.0) percentage = 100.0;
+		uint32_t idx = static_cast<uint32_t>(getNumPaletteColours() * percentage / 100);
+		return idx >= getNumPaletteColours() ? getNumPaletteColours() - 1 : idx;
+	}
+
+	// x and y are pixel number from bottom left corner; negative y counts
+	// from the top. colour is a palette index for 1, 4 and 8bpp.
+	void setPixel(uint32_t x, int32_t y, const value_type colour) {
+		y += (y >> 31) & m_pix_arr.getImageHeight(); // make sure y is indexed from bottom
+		Pixels::InternalSetPixel(m_pix_arr.getRow(y), x, colour);
+	}
+
+	value_type getPixel(uint32_t x, int32_t y) {
+		y += (y >> 31) & m_pix_arr.getImageHeight();
+		return Pixels::InternalGetPixel(m_pix_arr.getRow(y), x);
+	}
+
+	// The bulk operations below take x and y from the bottom left corner
+	// like setPixel, clip to the image, and work a row at a time with
+	// memset/memcpy rather than one indexed store per pixel.
+
+	void fillRect(int32_t x, int32_t y, int32_t width, int32_t height,
+		const value_type colour) {
+		if (!clipRect(x, y, width, height))
+			return;
+		if constexpr (BitsPerPix == 8) {
+			for (int32_t row = y; row < y + height; row++)
+				std::memset(m_pix_arr.getRow(row) + x, colour, width);
+		}
+		else if constexpr (BitsPerPix < 8) {
+			// whole bytes are set with the colour repeated across them,
+			// the partial bytes at either end a pixel at a time
+			constexpr int32_t per_byte = 8 / BitsPerPix;
+			uint8_t pattern = 0;
+			for (int32_t i = 0; i < per_byte; i++)
+				pattern = static_cast<uint8_t>(pattern << BitsPerPix | (colour & ((1u << BitsPerPix) - 1)));
+			const int32_t end = x + width;
+			const int32_t head = std::min(end, (x + per_byte - 1) / per_byte * per_byte);
+			const int32_t tail = std::max(head, end / per_byte * per_byte);
+			for (int32_t row = y; row < y + height; row++) {
+				uint8_t* pix = m_pix_arr.getRow(row);
+				for (int32_t i = x; i < head; i++)
+					Pixels::InternalSetPixel(pix, i, colour);
+				std::memset(pix + head / per_byte, pattern, (tail - head) / per_byte);
+				for (int32_t i = tail; i < end; i++)
+					Pixels::InternalSetPixel(pix, i, colour);
+			}
+		}
+		else {
+			constexpr size_t bytes = BitsPerPix / 8;
+			uint8_t* first = m_pix_arr.getRow(y);
+			for (int32_t i = x; i < x + width; i++)
+				Pixels::InternalSetPixel(first, i, colour);
+			for (int32_t row = y + 1; row < y + height; row++)
+				std::memcpy(m_pix_arr.getRow(row) + x * bytes, first + x * bytes, width * bytes);
+		}
+	}
+
+	inline void hLine(int32_t x, int32_t y, int32_t length, const value_type colour) {
+		fillRect(x, y, length, 1, colour);
+	}
+
+	void vLine(int32_t x, int32_t y, int32_t length, const value_type colour) {
+		int32_t width = 1;
+		if (!clipRect(x, y, width, length))
+			return;
+		const size_t stride = m_pix_arr.getRowStride();
+		uint8_t* row = m_pix_arr.getRow(y);
+		for (int32_t i = 0; i < length; i++, row += stride)
+			Pixels::InternalSetPixel(row, x, colour);
+	}
+
+	// Copies a src_width x src_height block of pixels in this bitmap's
+	// format, whose rows are src_stride bytes apart (bottom row first), to
+	// x, y
+	void blit(int32_t x, int32_t y, const uint8_t* src, int32_t src_width,
+		int32_t src_height, size_t src_stride) {
+		int32_t left = x, bottom = y;
+		int32_t width = src_width, height = src_height;
+		if (!clipRect(x, y, width, height))
+			return;
+		src += (y - bottom) * src_stride;
+		for (int32_t row = y; row < y + height; row++, src += src_stride)
+			copySpan(m_pix_arr.getRow(row), x, src, x - left, width);
+	}
+
+	// Linear ramp from `from` to `to` across the rectangle, left to right
+	// (or bottom to top if vertical). Colours are interpolated per channel.
+	// The ramp row is built once and copied to every row.
+	void fillGradient(int32_t x, int32_t y, int32_t width, int32_t height,
+		const value_type from, const value_type to, bool vertical = false) {
+		int32_t left = x, bottom = y;
+		int32_t full_width = width, full_height = height;
+		if (!clipRect(x, y, width, height))
+			return;
+		if (vertical) {
+			for (int32_t row = y; row < y + height; row++)
+				fillRect(x, row, width, 1, lerp(from, to, row - bottom, full_height));
+			return;
+		}
+		uint8_t* first = m_pix_arr.getRow(y);
+		for (int32_t i = x; i < x + width; i++)
+			Pixels::InternalSetPixel(first, i, lerp(from, to, i - left, full_width));
+		for (int32_t row = y + 1; row < y + height; row++)
+			copySpan(m_pix_arr.getRow(row), x, first, x, width);
+	}
+
+	// Sets every pixel to fn(x, y) on num_threads threads (0 = one per
+	// hardware thread). fn must be safe to call concurrently. The image is
+	// split into bands of whole rows, each starting on a cache line, so no
+	// two threads ever write the same line (row padding included; for a
+	// bitmap from open() this depends on the file's pixel offset); threads
+	// take the next band from a shared counter until none are left. If fn
+	// throws, the remaining bands are skipped and the exception is rethrown
+	// here.
+	template <typename Fn>
+	void render(Fn&& fn, unsigned num_threads = 0) {
+		const int32_t width = m_pix_arr.getImageWidth();
+		const int32_t height = m_pix_arr.getImageHeight();
+		if (width <= 0 || height <= 0)
+			return;
+
+		// bands of about render_band_bytes, rounded to a row count whose
+		// bytes are a whole number of cache lines
+		const size_t stride = m_pix_arr.getRowStride();
+		const size_t line_rows = Pixels::cache_line / std::gcd(stride, Pixels::cache_line);
+		size_t band_rows = std::max<size_t>(1, render_band_bytes / stride);
+		band_rows = (band_rows + line_rows - 1) / line_rows * line_rows;
+		const size_t num_bands = (height + band_rows - 1) / band_rows;
+
+		if (num_threads == 0)
+			num_threads = std::max(1u, std::thread::hardware_concurrency());
+		num_threads = static_cast<unsigned>(std::min<size_t>(num_threads, num_bands));
+
+		std::atomic<size_t> next_band{ 0 };
+		std::exception_ptr error;
+		std::mutex error_lock;
+		auto worker = [&]() {
+			for (size_t band; (band = next_band.fetch_add(1)) < num_bands;) {
+				try {
+					const int32_t first = static_cast<int32_t>(band * band_rows);
+					const int32_t end = std::min<int32_t>(height, first + static_cast<int32_t>(band_rows));
+					for (int32_t y = first; y < end; y++) {
+						uint8_t* row = m_pix_arr.getRow(y);
+						for (int32_t x = 0; x < width; x++)
+							Pixels::InternalSetPixel(row, x, fn(x, y));
+					}
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> guard(error_lock);
+					if (!error)
+						error = std::current_exception();
+					next_band = num_bands;
+				}
+			}
+		};
+
+		// the calling thread is one of the workers
+		std::vector<std::thread> threads;
+		threads.reserve(num_threads - 1);
+		for (unsigned i = 1; i < num_threads; i++) {
+			try {
+				threads.emplace_back(worker);
+			}
+			catch (const std::system_error&) {
+				break; // carry on with the threads we have
+			}
+		}
+		worker();
+		for (std::thread& thread : threads)
+			thread.join();
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	// grayScalePrctToIndex over count values, four at a time with SSE2
+	void grayScalePrctToIndex(const float* percentages, uint8_t* indices, size_t count)
+		requires Pixels::indexed {
+		constexpr uint32_t num_colours = getNumPaletteColours();
+		size_t i = 0;
+#ifdef BITMAP_HAVE_SSE2
+		// same clamp, multiply and divide as the scalar version, so the
+		// results match exactly
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 hundred = _mm_set1_ps(100.0f);
+		const __m128 colours = _mm_set1_ps(static_cast<float>(num_colours));
+		const __m128i last = _mm_set1_epi32(static_cast<int32_t>(num_colours - 1));
+		for (; i + 4 <= count; i += 4) {
+			__m128 p = _mm_loadu_ps(percentages + i);
+			p = _mm_min_ps(_mm_max_ps(p, zero), hundred);
+			__m128i idx = _mm_cvttps_epi32(_mm_div_ps(_mm_mul_ps(colours, p), hundred));
+			// idx <= num_colours, so one compare clamps it
+			__m128i over = _mm_cmpgt_epi32(idx, last);
+			idx = _mm_or_si128(_mm_and_si128(over, last), _mm_andnot_si128(over, idx));
+			idx = _mm_packs_epi32(idx, idx);
+			idx = _mm_packus_epi16(idx, idx);
+			int32_t packed = _mm_cvtsi128_si32(idx);
+			std::memcpy(indices + i, &packed, 4);
+		}
+#endif
+		for (; i < count; i++)
+			indices[i] = static_cast<uint8_t>(grayScalePrctToIndex(percentages[i]));
+	}
+
+	// For bitmaps from open(): writes every change made so far back to the
+	// file with msync. Throws std::logic_error for bitmaps not opened from
+	// a file.
+	void save() {
+		if (!m_pix_arr.isMapped())
+			throw std::logic_error("save() without a path needs a bitmap from Bitmap::open");
+		m_pix_arr.sync();
+	}
+
+	// Writes the file header, DIB header, palette and pixel array to path.
+	// With rle8 the pixels are BI_RLE8 encoded (compression type 1), which
+	// is much smaller for images with long flat runs; it needs 8bpp and
+	// throws std::invalid_argument otherwise. The header fields are updated
+	// to describe the file written. Throws std::system_error if the file
+	// cannot be written.
+	void save(const std::string& path, bool rle8 = false) {
+		// an opened file may have had a larger DIB header or a gap before
+		// the pixels; this writes the standard layout
+		m_dib_header_size = 40;
+		m_pix_arr_offset = 14 + 40 + getPaletteSize();
+
+		std::vector<uint8_t> encoded;
+		const uint8_t* pixels = m_pix_arr.getData();
+		uint64_t pixel_bytes = m_pix_arr.getByteSize();
+		if (rle8) {
+			if constexpr (BitsPerPix == 8) {
+				encoded = encodeRLE8();
+				pixels = encoded.data();
+				pixel_bytes = encoded.size();
+				m_compress_type = 1;
+			}
+			else {
+				throw std::invalid_argument("RLE8 compression needs an 8bpp bitmap");
+			}
+		}
+		else {
+			m_compress_type = 0;
+		}
+		m_image_size = headerSize(pixel_bytes);
+		m_file_size = headerSize(m_pix_arr_offset + pixel_bytes);
+
+		uint8_t headers[14 + 40];
+		writeHeaders(headers);
+
+		// headers, palette and pixels go out in one call, straight from
+		// where they are stored
+		const uint8_t* parts[3] = { headers, m_palette.get(), pixels };
+		size_t sizes[3] = { sizeof(headers), getPaletteSize(), static_cast<size_t>(pixel_bytes) };
+		writeFile(path, parts, sizes, 3);
+	}
+
+private:
+	// header fields are filled in by the public constructor or open()
+	explicit Bitmap(Pixels&& pix_arr) :
+		m_dib_header_size(40), m_colour_planes(1), m_compress_type(0),
+		m_horizontal_res(20), m_vertical_res(20), m_palette_colours(0),
+		m_important_colours(0), m_palette(std::make_unique<uint8_t[]>(getPaletteSize())),
+		m_pix_arr(std::move(pix_arr)) {
+	}
+
+	// clips a rectangle to the image; false if nothing is left
+	bool clipRect(int32_t& x, int32_t& y, int32_t& width, int32_t& height) {
+		if (x < 0) {
+			width += x;
+			x = 0;
+		}
+		if (y < 0) {
+			height += y;
+			y = 0;
+		}
+		width = std::min(width, m_pix_arr.getImageWidth() - x);
+		height = std::min(height, m_pix_arr.getImageHeight() - y);
+		return width > 0 && height > 0;
+	}
+
+	// copies width pixels from src_row at src_x to dst_row at dst_x
+	static void copySpan(uint8_t* dst_row, int32_t dst_x, const uint8_t* src_row,
+		int32_t src_x, int32_t width) {
+		if constexpr (BitsPerPix >= 8) {
+			constexpr size_t bytes = BitsPerPix / 8;
+			std::memcpy(dst_row + dst_x * bytes, src_row + src_x * bytes, width * bytes);
+		}
+		else {
+			// whole bytes can be copied when both sides share the alignment
+			constexpr int32_t per_byte = 8 / BitsPerPix;
+			int32_t i = 0;
+			if (dst_x % per_byte == src_x % per_byte) {
+				for (; i < width && (dst_x + i) % per_byte != 0; i++)
+					Pixels::InternalSetPixel(dst_row, dst_x + i,
+						Pixels::InternalGetPixel(src_row, src_x + i));
+				int32_t whole = (width - i) / per_byte;
+				std::memcpy(dst_row + (dst_x + i) / per_byte, src_row + (src_x + i) / per_byte, whole);
+				i += whole * per_byte;
+			}
+			for (; i < width; i++)
+				Pixels::InternalSetPixel(dst_row, dst_x + i,
+					Pixels::InternalGetPixel(src_row, src_x + i));
+		}
+	}
+
+	// step i of steps from `from` to `to`, per colour channel for 24/32bpp
+	static value_type lerp(value_type from, value_type to, int32_t i, int32_t steps) {
+		if (steps <= 1)
+			return from;
+		if constexpr (Pixels::indexed) {
+			return static_cast<value_type>(from + (to - from) * i / (steps - 1));
+		}
+		else {
+			uint32_t colour = 0;
+			for (int shift = 0; shift < BitsPerPix; shift += 8) {
+				int32_t a = (from >> shift) & 0xff;
+				int32_t b = (to >> shift) & 0xff;
+				colour |= static_cast<uint32_t>(a + (b - a) * i / (steps - 1)) << shift;
+			}
+			return colour;
+		}
+	}
+
+	// fills the 14-byte file header and 40-byte BITMAPINFOHEADER
+	void writeHeaders(uint8_t* out) {
+		out[0] = static_cast<uint8_t>(sig[0]);
+		out[1] = static_cast<uint8_t>(sig[1]);
+		putLE32(out + 2, m_file_size);
+		putLE16(out + 6, 0); // reserved 1
+		putLE16(out + 8, 0); // reserved 2
+		putLE32(out + 10, m_pix_arr_offset);
+
+		uint8_t* dib = out + 14;
+		putLE32(dib, m_dib_header_size);
+		putLE32(dib + 4, static_cast<uint32_t>(m_pix_arr.getImageWidth()));
+		putLE32(dib + 8, static_cast<uint32_t>(m_pix_arr.getImageHeight()));
+		putLE16(dib + 12, m_colour_planes);
+		putLE16(dib + 14, m_bits_per_pix);
+		putLE32(dib + 16, m_compress_type);
+		putLE32(dib + 20, m_image_size);
+		putLE32(dib + 24, m_horizontal_res);
+		putLE32(dib + 28, m_vertical_res);
+		putLE32(dib + 32, m_palette_colours);
+		putLE32(dib + 36, m_important_colours);
+	}
+
+	// BI_RLE8: runs of a repeated index become (count, index); stretches
+	// without runs of 3 or more are written in absolute mode (0, count,
+	// indices, padded to 16 bits). Each row ends with 0,0 and the image
+	// with 0,1. Row padding is not encoded.
+	std::vector<uint8_t> encodeRLE8() {
+		const int32_t width = m_pix_arr.getImageWidth();
+		const int32_t height = m_pix_arr.getImageHeight();
+		const uint8_t* data = m_pix_arr.getData();
+		std::vector<uint8_t> out;
+		out.reserve(m_pix_arr.getByteSize() / 4 + 2 * height + 2);
+
+		for (int32_t y = 0; y < height; y++) {
+			const uint8_t* row = data + static_cast<size_t>(m_pix_arr.getRowStride()) * y;
+			int32_t x = 0;
+			while (x < width) {
+				int32_t run = 1;
+				while (x + run < width && run < 255 && row[x + run] == row[x])
+					run++;
+				if (run >= 2) {
+					out.push_back(static_cast<uint8_t>(run));
+					out.push_back(row[x]);
+					x += run;
+					continue;
+				}
+
+				// literal stretch, up to the next run of 3
+				int32_t end = x;
+				while (end < width && end - x < 255) {
+					if (end + 2 < width && row[end] == row[end + 1] && row[end] == row[end + 2])
+						break;
+					end++;
+				}
+				int32_t count = end - x;
+				if (count < 3) {
+					// absolute mode needs at least 3 indices
+					for (int32_t i = x; i < end; i++) {
+						out.push_back(1);
+						out.push_back(row[i]);
+					}
+				}
+				else {
+					out.push_back(0);
+					out.push_back(static_cast<uint8_t>(count));
+					out.insert(out.end(), row + x, row + end);
+					if (count % 2 != 0)
+						out.push_back(0);
+				}
+				x = end;
+			}
+			out.push_back(0);
+			out.push_back(y + 1 == height ? 1 : 0); // end of bitmap / end of line
+		}
+		if (height == 0) {
+			out.push_back(0);
+			out.push_back(1);
+		}
+		return out;
+	}
+
+	// writes count buffers back to back into a new file at path
+	static void writeFile(const std::string& path, const uint8_t* const* parts,
+		const size_t* sizes, int count) {
+#ifdef _WIN32
+		std::ofstream file(path, std::ios::binary | std::ios::trunc);
+		if (!file)
+			throw std::system_error(errno, std::generic_category(), "unable to open " + path);
+		for (int i = 0; i < count; i++)
+			file.write(reinterpret_cast<const char*>(parts[i]), static_cast<std::streamsize>(sizes[i]));
+		file.close();
+		if (!file)
+			throw std::system_error(errno, std::generic_category(), "unable to write " + path);
+#else
+		int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			throw std::system_error(errno, std::generic_category(), "unable to open " + path);
+
+		struct iovec iov[3];
+		for (int i = 0; i < count; i++) {
+			iov[i].iov_base = const_cast<uint8_t*>(parts[i]);
+			iov[i].iov_len = sizes[i];
+		}
+		struct iovec* next = iov;
+		int remaining = count;
+		while (remaining > 0) {
+			ssize_t written = writev(fd, next, remaining);
+			if (written < 0) {
+				if (errno == EINTR)
+					continue;
+				int err = errno;
+				close(fd);
+				throw std::system_error(err, std::generic_category(), "unable to write " + path);
+			}
+			// skip whatever a short write already covered
+			size_t done = static_cast<size_t>(written);
+			while (remaining > 0 && done >= next->iov_len) {
+				done -= next->iov_len;
+				next++;
+				remaining--;
+			}
+			if (remaining > 0) {
+				next->iov_base = static_cast<uint8_t*>(next->iov_base) + done;
+				next->iov_len -= done;
+			}
+		}
+		if (close(fd) != 0)
+			throw std::system_error(errno, std::generic_category(), "unable to close " + path);
+#endif
+	}
+};
+
+
+// Writes a BMP too large to hold in memory. The headers are written up
+// front with the sizes worked out from the dimensions, then rows are
+// appended bottom-up (row 0 first) in the file's pixel format, a row or a
+// band at a time. Output goes through a buffer of buffer_size bytes, so
+// memory use depends on the width only, never the height. Throws
+// std::system_error on I/O failure.
+template <uint16_t BitsPerPix = 8>
+class BitmapWriter {
+public:
+	using Pixels = PixArr<BitsPerPix>;
+
+private:
+	int32_t m_image_width;
+	int32_t m_image_height;
+	int32_t m_rows_written;
+	uint32_t m_row_bytes;
+	uint32_t m_padding;
+
+	// File size and pixel array size, 64-bit so images past 4 GiB work
+	uint64_t m_file_size;
+	uint64_t m_image_size;
+
+	std::vector<uint8_t> m_buffer;
+	size_t m_buffer_len;
+
+#ifdef _WIN32
+	std::ofstream m_file;
+#else
+	int m_fd;
+#endif
+	std::string m_path;
+
+public:
+	BitmapWriter(const std::string& path, int32_t image_width, int32_t image_height,
+		size_t buffer_size = 1 << 20) :
+		m_image_width(image_width), m_image_height(image_height), m_rows_written(0),
+		m_row_bytes(Pixels::rowBytes(image_width)),
+		m_padding(Pixels::rowStride(image_width) - Pixels::rowBytes(image_width)),
+		m_buffer(std::max<size_t>(buffer_size, 14 + 40 + Bitmap<BitsPerPix>::getPaletteSize())),
+		m_buffer_len(0), m_path(path) {
+		const uint32_t pix_arr_offset = 14 + 40 + Bitmap<BitsPerPix>::getPaletteSize();
+		m_image_size = Pixels::imageBytes(image_width, image_height);
+		m_file_size = pix_arr_offset + m_image_size;
+
+#ifdef _WIN32
+		m_file.open(path, std::ios::binary | std::ios::trunc);
+		if (!m_file)
+			throw std::system_error(errno, std::generic_category(), "unable to open " + path);
+#else
+		m_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (m_fd < 0)
+			throw std::system_error(errno, std::generic_category(), "unable to open " + path);
+#endif
+
+		// same header fields as Bitmap::save
+		uint8_t* out = m_buffer.data();
+		out[0] = 'B';
+		out[1] = 'M';
+		putLE32(out + 2, headerSize(m_file_size));
+		putLE16(out + 6, 0); // reserved 1
+		putLE16(out + 8, 0); // reserved 2
+		putLE32(out + 10, pix_arr_offset);
+
+		uint8_t* dib = out + 14;
+		putLE32(dib, 40);
+		putLE32(dib + 4, static_cast<uint32_t>(image_width));
+		putLE32(dib + 8, static_cast<uint32_t>(image_height));
+		putLE16(dib + 12, 1); // colour planes
+		putLE16(dib + 14, BitsPerPix);
+		putLE32(dib + 16, 0); // no compression
+		putLE32(dib + 20, headerSize(m_image_size));
+		putLE32(dib + 24, 20); // horizontal res
+		putLE32(dib + 28, 20); // vertical res
+		putLE32(dib + 32, 0); // palette colours
+		putLE32(dib + 36, 0); // important colours
+		Bitmap<BitsPerPix>::fillPalette(dib + 40);
+		m_buffer_len = pix_arr_offset;
+	}
+
+	BitmapWriter(const BitmapWriter&) = delete;
+	BitmapWriter& operator=(const BitmapWriter&) = delete;
+
+	// Closes the file if close() was not called, ignoring errors
+	~BitmapWriter() {
+		try {
+			close();
+		}
+		catch (...) {
+		}
+	}
+
+	inline int32_t getRowsWritten() {
+		return m_rows_written;
+	}
+
+	// appends one row of rowBytes(width) bytes; the padding is added here
+	void writeRow(const uint8_t* row) {
+		writeRows(row, 1, m_row_bytes);
+	}
+
+	// appends count rows that are stride bytes apart, bottom row first
+	void writeRows(const uint8_t* rows, int32_t count, size_t stride) {
+		if (count < 0 || count > m_image_height - m_rows_written)
+			throw std::out_of_range("more rows than the image height in " + m_path);
+		static const uint8_t zeros[4] = {};
+		for (int32_t i = 0; i < count; i++, rows += stride) {
+			append(rows, m_row_bytes);
+			append(zeros, m_padding);
+		}
+		m_rows_written += count;
+	}
+
+	// appends every row of band, which must be as wide as the image. The
+	// band can be filled with Bitmap's drawing calls or render().
+	void writeBand(Bitmap<BitsPerPix>& band) {
+		if (band.getImageWidth() != m_image_width)
+			throw std::invalid_argument("band width does not match " + m_path);
+		writeRows(band.getData(), band.getImageHeight(), band.getRowStride());
+	}
+
+	// Writes out the buffer and closes the file. Throws std::logic_error if
+	// fewer rows than the image height were written.
+	void close() {
+		if (!isOpen())
+			return;
+		try {
+			flush();
+		}
+		catch (...) {
+			closeFile();
+			throw;
+		}
+		closeFile();
+		if (m_rows_written != m_image_height)
+			throw std::logic_error("only " + std::to_string(m_rows_written) + " of " +
+				std::to_string(m_image_height) + " rows written to " + m_path);
+	}
+
+private:
+	void append(const uint8_t* data, size_t len) {
+		if (len > m_buffer.size() - m_buffer_len) {
+			flush();
+			// rows wider than the buffer go straight out
+			if (len > m_buffer.size()) {
+				writeOut(data, len);
+				return;
+			}
+		}
+		std::memcpy(m_buffer.data() + m_buffer_len, data, len);
+		m_buffer_len += len;
+	}
+
+	void flush() {
+		writeOut(m_buffer.data(), m_buffer_len);
+		m_buffer_len = 0;
+	}
+
+	void writeOut(const uint8_t* data, size_t len) {
+#ifdef _WIN32
+		m_file.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(len));
+		if (!m_file)
+			throw std::system_error(errno, std::generic_category(), "unable to write " + m_path);
+#else
+		while (len > 0) {
+			ssize_t written = ::write(m_fd, data, len);
+			if (written < 0) {
+				if (errno == EINTR)
+					continue;
+				throw std::system_error(errno, std::generic_category(), "unable to write " + m_path);
+			}
+			data += written;
+			len -= static_cast<size_t>(written);
+		}
+#endif
+	}
+
+	bool isOpen() {
+#ifdef _WIN32
+		return m_file.is_open();
+#else
+		return m_fd >= 0;
+#endif
+	}
+
+	void closeFile() {
+#ifdef _WIN32
+		m_file.close();
+		if (!m_file)
+			throw std::system_error(errno, std::generic_category(), "unable to close " + m_path);
+#else
+		int fd = m_fd;
+		m_fd = -1;
+		if (::close(fd) != 0)
+			throw std::system_error(errno, std::generic_category(), "unable to close " + m_path);
+#endif
+	}
+};
@@ -0,0 +1,182 @@
+﻿// learn_cpp_bitmap_2025_bench.cpp : timings for the Bitmap bulk operations
+// against the equivalent setPixel loops, and for render() on 1 to N
+// threads. Configure with
+// -DCMAKE_BUILD_TYPE=Release for meaningful numbers, then run
+// learn_cpp_bitmap_2025_bench [suite...]; with no suite names all run.
+#include "learn_cpp_bitmap_2025.h"
+
+#include <chrono>
+#include <cstdio>
+
+namespace {
+
+constexpr int bench_runs = 5;
+
+// frame size used by the "ops" suite: a 4K greyscale frame
+constexpr int32_t frame_width = 3840;
+constexpr int32_t frame_height = 2160;
+
+// image size used by the "render" suite
+constexpr int32_t render_size = 4096;
+
+// keeps the compiler from dropping work whose result is never read
+volatile uint32_t sink;
+
+// best wall time of bench_runs calls of fn, in milliseconds
+template <typename Fn>
+double bestOf(Fn&& fn) {
+	double best = 0;
+	for (int run = 0; run < bench_runs; run++) {
+		auto start = std::chrono::steady_clock::now();
+		fn();
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		if (run == 0 || elapsed.count() < best)
+			best = elapsed.count();
+	}
+	return best;
+}
+
+void report(const char* name, double bulk_ms, double loop_ms) {
+	std::printf("  %-22s %9.2f ms   setPixel loop %9.2f ms   %6.1fx\n",
+		name, bulk_ms, loop_ms, loop_ms / bulk_ms);
+}
+
+// Each bulk operation on a full frame against the setPixel loop that
+// produces the same pixels
+void benchOps() {
+	std::printf("ops: %dx%d 8bpp, best of %d runs\n", frame_width, frame_height, bench_runs);
+	Bitmap<> bitmap(frame_width, frame_height);
+
+	auto loop_fill = [&](uint8_t colour) {
+		for (int32_t y = 0; y < frame_height; y++)
+			for (int32_t x = 0; x < frame_width; x++)
+				bitmap.setPixel(x, y, colour);
+	};
+	report("fillRect",
+		bestOf([&] { bitmap.fillRect(0, 0, frame_width, frame_height, 200); }),
+		bestOf([&] { loop_fill(200); }));
+
+	report("hLine (every row)",
+		bestOf([&] {
+			for (int32_t y = 0; y < frame_height; y++)
+				bitmap.hLine(0, y, frame_width, 100);
+		}),
+		bestOf([&] { loop_fill(100); }));
+
+	report("vLine (every column)",
+		bestOf([&] {
+			for (int32_t x = 0; x < frame_width; x++)
+				bitmap.vLine(x, 0, frame_height, 50);
+		}),
+		bestOf([&] {
+			for (int32_t x = 0; x < frame_width; x++)
+				for (int32_t y = 0; y < frame_height; y++)
+					bitmap.setPixel(x, y, 50);
+		}));
+
+	const size_t stride = frame_width;
+	std::vector<uint8_t> source(stride * frame_height);
+	for (size_t i = 0; i < source.size(); i++)
+		source[i] = static_cast<uint8_t>(i * 7);
+	report("blit",
+		bestOf([&] { bitmap.blit(0, 0, source.data(), frame_width, frame_height, stride); }),
+		bestOf([&] {
+			for (int32_t y = 0; y < frame_height; y++)
+				for (int32_t x = 0; x < frame_width; x++)
+					bitmap.setPixel(x, y, source[y * stride + x]);
+		}));
+
+	report("fillGradient",
+		bestOf([&] { bitmap.fillGradient(0, 0, frame_width, frame_height, 0, 255); }),
+		bestOf([&] {
+			for (int32_t y = 0; y < frame_height; y++)
+				for (int32_t x = 0; x < frame_width; x++)
+					bitmap.setPixel(x, y, static_cast<uint8_t>(255 * x / (frame_width - 1)));
+		}));
+
+	// array conversion plus a blit, against converting and setting each pixel
+	std::vector<float> percentages(static_cast<size_t>(frame_width) * frame_height);
+	for (size_t i = 0; i < percentages.size(); i++)
+		percentages[i] = static_cast<float>(i % 1000) / 10;
+	std::vector<uint8_t> indices(percentages.size());
+	report("grayScalePrctToIndex",
+		bestOf([&] {
+			bitmap.grayScalePrctToIndex(percentages.data(), indices.data(), indices.size());
+			bitmap.blit(0, 0, indices.data(), frame_width, frame_height, frame_width);
+		}),
+		bestOf([&] {
+			for (int32_t y = 0; y < frame_height; y++)
+				for (int32_t x = 0; x < frame_width; x++)
+					bitmap.setPixel(x, y, static_cast<uint8_t>(
+						bitmap.grayScalePrctToIndex(percentages[y * frame_width + x])));
+		}));
+
+	sink = bitmap.getPixel(frame_width / 2, frame_height / 2);
+}
+
+// a few rounds of integer mixing per pixel, so the shading dominates the
+// stores the way a real shading function would
+uint8_t shade(int32_t x, int32_t y) {
+	uint32_t h = static_cast<uint32_t>(x) * 0x9E3779B1u ^ static_cast<uint32_t>(y) * 0x85EBCA77u;
+	for (int i = 0; i < 8; i++)
+		h = (h ^ (h >> 15)) * 0x2C1B3C6Du;
+	return static_cast<uint8_t>(h >> 24);
+}
+
+// render(shade) on 1, 2, 4, ... threads up to the hardware thread count,
+// against a serial setPixel loop
+void benchRender() {
+	const unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+	std::printf("render: %dx%d 8bpp, up to %u threads, best of %d runs\n",
+		render_size, render_size, max_threads, bench_runs);
+	Bitmap<> bitmap(render_size, render_size);
+
+	const double loop_ms = bestOf([&] {
+		for (int32_t y = 0; y < render_size; y++)
+			for (int32_t x = 0; x < render_size; x++)
+				bitmap.setPixel(x, y, shade(x, y));
+	});
+	std::printf("  %-22s %9.2f ms\n", "setPixel loop", loop_ms);
+
+	double one_thread_ms = 0;
+	for (unsigned threads = 1; threads <= max_threads;
+		threads = threads == max_threads ? max_threads + 1 : std::min(threads * 2, max_threads)) {
+		const double ms = bestOf([&] { bitmap.render(shade, threads); });
+		if (threads == 1)
+			one_thread_ms = ms;
+		std::printf("  render, %3u threads    %9.2f ms   %6.2fx vs 1 thread   %6.2fx vs loop\n",
+			threads, ms, one_thread_ms / ms, loop_ms / ms);
+	}
+	sink = bitmap.getPixel(render_size / 2, render_size / 2);
+}
+
+struct BenchSuite {
+	const char* name;
+	void (*run)();
+};
+
+const BenchSuite suites[] = {
+	{ "ops", benchOps },
+	{ "render", benchRender },
+};
+
+}
+
+int main(int argc, char** argv)
+{
+	for (int arg = 1; arg < argc; arg++) {
+		if (std::none_of(std::begin(suites), std::end(suites),
+			[&](const BenchSuite& suite) { return std::strcmp(argv[arg], suite.name) == 0; })) {
+			std::fprintf(stderr, "unknown suite %s\n", argv[arg]);
+			return 1;
+		}
+	}
+	for (const BenchSuite& suite : suites) {
+		bool selected = argc == 1;
+		for (int arg = 1; arg < argc; arg++)
+			selected = selected || std::strcmp(argv[arg], suite.name) == 0;
+		if (selected)
+			suite.run();
+	}
+	return 0;
+}